@@ -0,0 +1,60 @@
+/*
+ *  In-memory account records for the bank server.
+ *
+ *  Each account gets one cache line holding its lock, its last
+ *  committed balance and a version counter, so taking the lock
+ *  pulls the balance in with it and neighbouring accounts never
+ *  share a line. The storage copy in Bank.c stays the source of
+ *  truth, the balance here mirrors it after every commit.
+ *
+ *  Building with -DACCOUNT_ALIGN=16 and one of the 4 or 8 byte locks from
+ *  AcctLock.h packs records densely when memory matters more than false
+ *  sharing, e.g. millions of accounts.
+ */
+
+#ifndef ACCOUNT_H
+#define ACCOUNT_H
+
+#include <stdint.h>
+#include "AcctLock.h"
+
+#define CACHE_LINE 64
+
+#ifndef ACCOUNT_ALIGN
+#define ACCOUNT_ALIGN CACHE_LINE
+#endif
+
+struct account {
+    acct_lock_t lock;
+    //Last committed balance
+    int64_t balance;
+    //Seqlock around balance: odd while a commit is installing a new value
+    uint32_t version;
+} __attribute__((aligned(ACCOUNT_ALIGN)));
+
+/*
+ *  Install a new committed balance, the caller must hold the account lock
+ */
+static inline void account_install(struct account* acct, int64_t balance) {
+    __atomic_store_n(&acct->version, acct->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&acct->balance, balance, __ATOMIC_RELAXED);
+    __atomic_store_n(&acct->version, acct->version + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Read the committed balance without taking the lock
+ *  Output: int64_t* balance - The balance, only valid if 1 is returned
+ *  Return:  1 if the read was consistent, 0 if a commit was in progress
+ */
+static inline int account_peek(struct account* acct, int64_t* balance) {
+    uint32_t before = __atomic_load_n(&acct->version, __ATOMIC_ACQUIRE);
+    if (before & 1) {
+        return 0;
+    }
+    *balance = __atomic_load_n(&acct->balance, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&acct->version, __ATOMIC_RELAXED) == before;
+}
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ *  Per-account locks for the bank server, chosen at build time:
+ *
+ *  ACCT_LOCK_SEM    POSIX sem_t, 32 bytes (default)
+ *  ACCT_LOCK_FUTEX  4-byte futex lock, spins for a while before parking
+ *                   in the kernel, the spin budget adapts per thread
+ *  ACCT_LOCK_MCS    MCS queue lock, 8 bytes, waiters spin on their own
+ *                   node and are handed the lock in FIFO order, meant
+ *                   for heavily contended accounts
+ *
+ *  Every variant takes a struct acct_lock_node from the caller. Only the
+ *  MCS lock uses it, and the node must stay in place from acquire until
+ *  release. All three implementations are always compiled so benchmarks
+ *  can compare them, the acct_lock_* names map to the selected one.
+ */
+
+#ifndef ACCT_LOCK_H
+#define ACCT_LOCK_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+//Upper bound and starting point for the adaptive spin budget
+#define LOCK_SPIN_MAX 1000
+#define LOCK_SPIN_START 100
+
+struct acct_lock_node {
+    struct acct_lock_node* next;
+    //1 while waiting for the lock, 2 once parked in the kernel, 0 when handed the lock
+    uint32_t wait;
+};
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline void futex_wait(uint32_t* addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t* addr, int cnt) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, cnt, NULL, NULL, 0);
+}
+
+//--------------POSIX semaphore--------------
+static inline void sem_lock_init(sem_t* l) {
+    sem_init(l, 0, 1);
+}
+
+static inline void sem_lock_acquire(sem_t* l, struct acct_lock_node* n) {
+    sem_wait(l);
+}
+
+static inline int sem_lock_try(sem_t* l, struct acct_lock_node* n) {
+    return sem_trywait(l) == 0;
+}
+
+static inline void sem_lock_release(sem_t* l, struct acct_lock_node* n) {
+    sem_post(l);
+}
+
+//--------------Futex lock--------------
+//0 unlocked, 1 locked, 2 locked with possible sleepers
+typedef uint32_t futex_lock_t;
+
+//How long this thread spins before parking, grows when spinning pays off
+static __thread int spin_budget = LOCK_SPIN_START;
+
+static inline void futex_lock_init(futex_lock_t* l) {
+    *l = 0;
+}
+
+static inline int futex_lock_try(futex_lock_t* l, struct acct_lock_node* n) {
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(l, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void futex_lock_acquire(futex_lock_t* l, struct acct_lock_node* n) {
+    if (futex_lock_try(l, n)) {
+        return;
+    }
+    //Spin while the holder is likely to let go soon
+    for (int i = 0; i < spin_budget; i++) {
+        cpu_relax();
+        if (__atomic_load_n(l, __ATOMIC_RELAXED) == 0 && futex_lock_try(l, n)) {
+            if (spin_budget < LOCK_SPIN_MAX) {
+                spin_budget += spin_budget / 8 + 1;
+            }
+            return;
+        }
+    }
+    //Spinning did not pay off this time so spin less next time and park
+    if (spin_budget > 1) {
+        spin_budget /= 2;
+    }
+    while (__atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait(l, 2);
+    }
+}
+
+static inline void futex_lock_release(futex_lock_t* l, struct acct_lock_node* n) {
+    if (__atomic_exchange_n(l, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake(l, 1);
+    }
+}
+
+//--------------MCS queue lock--------------
+//Points at the last node in the queue, NULL when unlocked
+typedef struct acct_lock_node* mcs_lock_t;
+
+static inline void mcs_lock_init(mcs_lock_t* l) {
+    *l = NULL;
+}
+
+static inline int mcs_lock_try(mcs_lock_t* l, struct acct_lock_node* n) {
+    struct acct_lock_node* expected = NULL;
+    n->next = NULL;
+    return __atomic_compare_exchange_n(l, &expected, n, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void mcs_lock_acquire(mcs_lock_t* l, struct acct_lock_node* n) {
+    n->next = NULL;
+    n->wait = 1;
+    struct acct_lock_node* prev = __atomic_exchange_n(l, n, __ATOMIC_ACQ_REL);
+    if (prev == NULL) {
+        return;
+    }
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+
+    //Spin on our own node, then park until the previous holder hands the lock over
+    for (int i = 0; i < spin_budget; i++) {
+        if (__atomic_load_n(&n->wait, __ATOMIC_ACQUIRE) == 0) {
+            return;
+        }
+        cpu_relax();
+    }
+    uint32_t expected = 1;
+    if (__atomic_compare_exchange_n(&n->wait, &expected, 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&n->wait, __ATOMIC_ACQUIRE) != 0) {
+            futex_wait(&n->wait, 2);
+        }
+    }
+}
+
+static inline void mcs_lock_release(mcs_lock_t* l, struct acct_lock_node* n) {
+    struct acct_lock_node* next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        //Nobody queued behind us, try to mark the lock free
+        struct acct_lock_node* expected = n;
+        if (__atomic_compare_exchange_n(l, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        //Someone is in the middle of queueing, wait for them to link in
+        while ((next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE)) == NULL) {
+            cpu_relax();
+        }
+    }
+    //Hand the lock straight to the next waiter
+    if (__atomic_exchange_n(&next->wait, 0, __ATOMIC_RELEASE) == 2) {
+        futex_wake(&next->wait, 1);
+    }
+}
+
+//--------------Build time selection--------------
+#if defined(ACCT_LOCK_FUTEX)
+typedef futex_lock_t acct_lock_t;
+#define ACCT_LOCK_NAME "futex"
+#define acct_lock_init futex_lock_init
+#define acct_lock_acquire futex_lock_acquire
+#define acct_lock_try futex_lock_try
+#define acct_lock_release futex_lock_release
+#elif defined(ACCT_LOCK_MCS)
+typedef mcs_lock_t acct_lock_t;
+#define ACCT_LOCK_NAME "mcs"
+#define acct_lock_init mcs_lock_init
+#define acct_lock_acquire mcs_lock_acquire
+#define acct_lock_try mcs_lock_try
+#define acct_lock_release mcs_lock_release
+#else
+typedef sem_t acct_lock_t;
+#define ACCT_LOCK_NAME "sem"
+#define acct_lock_init sem_lock_init
+#define acct_lock_acquire sem_lock_acquire
+#define acct_lock_try sem_lock_try
+#define acct_lock_release sem_lock_release
+#endif
+
+#endif
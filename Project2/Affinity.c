@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "Affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+//Largest node number we build masks for
+#define MAX_NODES 64
+
+int worker_pin_mode = PIN_NONE;
+//CPUs workers may be placed on, in the order they are handed out
+int* worker_cpus = NULL;
+int worker_cpu_cnt = 0;
+
+/*
+ *  Parse a CPU list such as "0-3,8,10-11" into cpus
+ *  Return:  Number of CPUs in the list, 0 if it is malformed
+ */
+int parse_cpu_list(char* list, int* cpus, int max) {
+    int cnt = 0;
+    char* p = list;
+    while (*p != '\0') {
+        char* end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if (end == p || lo < 0) {
+            return 0;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) {
+                return 0;
+            }
+        }
+        for (long cpu = lo; cpu <= hi && cnt < max; cpu++) {
+            cpus[cnt++] = (int)cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return 0;
+        }
+        p = end;
+    }
+    return cnt;
+}
+
+int affinity_configure( int mode, char* cpus ) {
+    int max = CPU_SETSIZE;
+
+    worker_pin_mode = mode;
+    if (mode == PIN_NONE) {
+        return 1;
+    }
+    free(worker_cpus);
+    worker_cpus = malloc(max * sizeof(int));
+    if (cpus != NULL) {
+        worker_cpu_cnt = parse_cpu_list(cpus, worker_cpus, max);
+        return worker_cpu_cnt > 0;
+    }
+
+    //No list given so use every CPU we are currently allowed on
+    cpu_set_t allowed;
+    worker_cpu_cnt = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < max; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                worker_cpus[worker_cpu_cnt++] = cpu;
+            }
+        }
+    }
+    return worker_cpu_cnt > 0;
+}
+
+void affinity_pin_worker( int worker ) {
+    cpu_set_t set;
+
+    if (worker_pin_mode == PIN_NONE || worker_cpu_cnt == 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    if (worker_pin_mode == PIN_CORES) {
+        CPU_SET(worker_cpus[worker % worker_cpu_cnt], &set);
+    } else {
+        for (int i = 0; i < worker_cpu_cnt; i++) {
+            CPU_SET(worker_cpus[i], &set);
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        printf("WARNING: Could not pin worker %d\n", worker);
+    }
+}
+
+//Fill nodes with the IDs of the online nodes that have memory, returns how many there are
+int memory_nodes(int* nodes) {
+    char list[256];
+    int cnt = 0;
+
+    FILE* f = fopen("/sys/devices/system/node/has_memory", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fgets(list, sizeof(list), f) != NULL) {
+        list[strcspn(list, "\n")] = '\0';
+        cnt = parse_cpu_list(list, nodes, MAX_NODES);
+    }
+    fclose(f);
+    return cnt;
+}
+
+int affinity_node_count() {
+    int nodes[MAX_NODES];
+    int cnt = memory_nodes(nodes);
+    return cnt > 0 ? cnt : 1;
+}
+
+//Thin wrapper so we do not need to link libnuma
+long bind_pages(void* addr, size_t len, int policy, unsigned long* mask) {
+    return syscall(SYS_mbind, addr, len, policy, mask, (unsigned long)MAX_NODES, MPOL_MF_MOVE);
+}
+
+void affinity_place_memory( void* addr, size_t len, int mode ) {
+    long page = sysconf(_SC_PAGESIZE);
+    int node_ids[MAX_NODES];
+    int nodes = memory_nodes(node_ids);
+
+    if (mode == NUMA_NONE || nodes < 2) {
+        return;
+    }
+    //mbind only works on whole pages so shrink the range to the pages inside it
+    unsigned long start = ((unsigned long)addr + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long)addr + len) & ~(page - 1);
+    if (end <= start) {
+        return;
+    }
+
+    unsigned long mask = 0;
+    for (int i = 0; i < nodes; i++) {
+        mask |= 1UL << node_ids[i];
+    }
+    if (bind_pages((void*)start, end - start, MPOL_INTERLEAVE, &mask) != 0) {
+        printf("WARNING: Could not interleave memory over %d nodes\n", nodes);
+    }
+}
+
+void* affinity_alloc( size_t len ) {
+    void* mem = NULL;
+    if (posix_memalign(&mem, sysconf(_SC_PAGESIZE), len) != 0) {
+        return NULL;
+    }
+    return mem;
+}
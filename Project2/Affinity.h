@@ -0,0 +1,59 @@
+/*
+ *  CPU pinning and NUMA placement for the bank server.
+ *  Everything here is best effort: if the machine has a single
+ *  node or the kernel refuses a request the server keeps running
+ *  with the default placement.
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+
+#define PIN_NONE 0
+//Each worker is pinned to one CPU of the list, round robin
+#define PIN_CORES 1
+//Every worker may run on any CPU of the list
+#define PIN_SET 2
+
+#define NUMA_NONE 0
+//Pages are spread round robin over all nodes
+#define NUMA_INTERLEAVE 1
+
+/*
+ *  Set how workers are pinned.
+ *  Input:  int mode - PIN_NONE, PIN_CORES or PIN_SET
+ *  Input:  char* cpus - CPU list such as "0-3,8", NULL for every online CPU
+ *  Return:  1 if succeeded, 0 if the CPU list could not be parsed
+ */
+int affinity_configure( int mode, char* cpus );
+
+/*
+ *  Pin the calling worker thread according to the configured mode
+ *  Input:  int worker - Index of the worker, counting from 0
+ */
+void affinity_pin_worker( int worker );
+
+/*
+ *  Number of NUMA nodes with memory that are online, at least 1
+ */
+int affinity_node_count();
+
+/*
+ *  Apply a NUMA policy to memory that is already allocated, moving
+ *  pages that were touched before the call. Only whole pages inside
+ *  the range are affected.
+ *  Input:  void* addr - Start of the array
+ *  Input:  size_t len - Length of the array in bytes
+ *  Input:  int mode - NUMA_NONE or NUMA_INTERLEAVE
+ */
+void affinity_place_memory( void* addr, size_t len, int mode );
+
+/*
+ *  Allocate page aligned memory so affinity_place_memory() covers all of it
+ *  Input:  size_t len - Number of bytes to allocate
+ *  Return:  Pointer to the memory, release with free()
+ */
+void* affinity_alloc( size_t len );
+
+#endif
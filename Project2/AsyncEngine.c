@@ -0,0 +1,279 @@
+#include "AsyncEngine.h"
+#include "Bank.h"
+#include "Probes.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+//Reads and writes waiting for an I/O thread, shared by every loop
+pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+struct async_task* io_head = NULL;
+struct async_task* io_tail = NULL;
+int io_stop = 0;
+pthread_t* io_threads = NULL;
+int io_count = 0;
+
+int64_t async_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void async_loop_init( struct async_loop* loop ) {
+    loop->timer_cap = 64;
+    loop->timer_cnt = 0;
+    loop->timers = (struct async_task**)malloc(loop->timer_cap * sizeof(struct async_task*));
+    loop->ready_head = NULL;
+    loop->ready_tail = NULL;
+    pthread_mutex_init(&loop->done_mutex, NULL);
+    loop->done_head = NULL;
+    loop->done_tail = NULL;
+    sem_init(&loop->done_avail, 0, 0);
+    loop->tasks = NULL;
+    loop->inflight = 0;
+}
+
+void async_loop_free( struct async_loop* loop ) {
+    free(loop->timers);
+    loop->timers = NULL;
+    pthread_mutex_destroy(&loop->done_mutex);
+    sem_destroy(&loop->done_avail);
+}
+
+//--------------I/O threads--------------
+//Run queued reads and writes on Bank.c's blocking calls and hand each task back to its loop
+void* io_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&io_mutex);
+        while (io_head == NULL && !io_stop) {
+            pthread_cond_wait(&io_cond, &io_mutex);
+        }
+        struct async_task* t = io_head;
+        if (t == NULL) {
+            pthread_mutex_unlock(&io_mutex);
+            return NULL;
+        }
+        io_head = t->next_ready;
+        if (io_head == NULL) {
+            io_tail = NULL;
+        }
+        pthread_mutex_unlock(&io_mutex);
+
+        if (t->op == ASYNC_OP_READ) {
+            t->value = read_account(t->op_id);
+            BANK_PROBE2(read_end, t->op_id, t->value);
+        } else {
+            write_account(t->op_id, t->op_value);
+            BANK_PROBE1(write_end, t->op_id);
+        }
+
+        struct async_loop* loop = t->loop;
+        t->next_ready = NULL;
+        pthread_mutex_lock(&loop->done_mutex);
+        if (loop->done_tail == NULL) {
+            loop->done_head = t;
+        } else {
+            loop->done_tail->next_ready = t;
+        }
+        loop->done_tail = t;
+        pthread_mutex_unlock(&loop->done_mutex);
+        sem_post(&loop->done_avail);
+    }
+}
+
+int async_io_start( int threads ) {
+    io_threads = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&io_threads[io_count], NULL, io_thread, NULL) == 0) {
+            io_count++;
+        }
+    }
+    return io_count > 0;
+}
+
+void async_io_stop() {
+    pthread_mutex_lock(&io_mutex);
+    io_stop = 1;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+    for (int i = 0; i < io_count; i++) {
+        pthread_join(io_threads[i], NULL);
+    }
+    free(io_threads);
+    io_threads = NULL;
+    io_count = 0;
+}
+
+//--------------Timer heap--------------
+void timer_push(struct async_loop* loop, struct async_task* t) {
+    if (loop->timer_cnt == loop->timer_cap) {
+        loop->timer_cap *= 2;
+        loop->timers = (struct async_task**)realloc(loop->timers, loop->timer_cap * sizeof(struct async_task*));
+    }
+    int i = loop->timer_cnt++;
+    while (i > 0 && loop->timers[(i - 1) / 2]->due_ns > t->due_ns) {
+        loop->timers[i] = loop->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    loop->timers[i] = t;
+}
+
+struct async_task* timer_pop(struct async_loop* loop) {
+    struct async_task* top = loop->timers[0];
+    struct async_task* last = loop->timers[--loop->timer_cnt];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= loop->timer_cnt) {
+            break;
+        }
+        if (child + 1 < loop->timer_cnt && loop->timers[child + 1]->due_ns < loop->timers[child]->due_ns) {
+            child++;
+        }
+        if (last->due_ns <= loop->timers[child]->due_ns) {
+            break;
+        }
+        loop->timers[i] = loop->timers[child];
+        i = child;
+    }
+    if (loop->timer_cnt > 0) {
+        loop->timers[i] = last;
+    }
+    return top;
+}
+
+//--------------Task operations--------------
+void async_start( struct async_loop* loop, struct async_task* t ) {
+    t->loop = loop;
+    t->op = ASYNC_OP_NONE;
+    t->next_ready = NULL;
+    if (loop->ready_tail == NULL) {
+        loop->ready_head = t;
+    } else {
+        loop->ready_tail->next_ready = t;
+    }
+    loop->ready_tail = t;
+    t->prev_task = NULL;
+    t->next_task = loop->tasks;
+    if (loop->tasks != NULL) {
+        loop->tasks->prev_task = t;
+    }
+    loop->tasks = t;
+    loop->inflight++;
+}
+
+//Queue a read or write for the I/O threads
+int submit_io(struct async_task* t, int op, int id, int value) {
+    t->op = op;
+    t->op_id = id;
+    t->op_value = value;
+    t->next_ready = NULL;
+    pthread_mutex_lock(&io_mutex);
+    if (io_tail == NULL) {
+        io_head = t;
+    } else {
+        io_tail->next_ready = t;
+    }
+    io_tail = t;
+    pthread_cond_signal(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+    return ASYNC_SUSPENDED;
+}
+
+int async_read( struct async_loop* loop, struct async_task* t, int id ) {
+    (void)loop;
+    BANK_PROBE1(read_start, id);
+    return submit_io(t, ASYNC_OP_READ, id, 0);
+}
+
+int async_write( struct async_loop* loop, struct async_task* t, int id, int value ) {
+    (void)loop;
+    BANK_PROBE2(write_start, id, value);
+    return submit_io(t, ASYNC_OP_WRITE, id, value);
+}
+
+int async_sleep( struct async_loop* loop, struct async_task* t, int64_t nsec ) {
+    t->op = ASYNC_OP_SLEEP;
+    t->due_ns = async_now() + nsec;
+    timer_push(loop, t);
+    return ASYNC_SUSPENDED;
+}
+
+//Run a task until it suspends again or finishes
+void resume(struct async_loop* loop, struct async_task* t, void (*finish)(struct async_task*)) {
+    t->op = ASYNC_OP_NONE;
+    if (t->step(t) == ASYNC_DONE) {
+        if (t->prev_task == NULL) {
+            loop->tasks = t->next_task;
+        } else {
+            t->prev_task->next_task = t->next_task;
+        }
+        if (t->next_task != NULL) {
+            t->next_task->prev_task = t->prev_task;
+        }
+        loop->inflight--;
+        finish(t);
+    }
+}
+
+void async_run( struct async_loop* loop, void (*finish)(struct async_task*) ) {
+    //New tasks first, they may suspend straight away on their first read
+    while (loop->ready_head != NULL) {
+        struct async_task* t = loop->ready_head;
+        loop->ready_head = t->next_ready;
+        if (loop->ready_head == NULL) {
+            loop->ready_tail = NULL;
+        }
+        resume(loop, t, finish);
+    }
+    pthread_mutex_lock(&loop->done_mutex);
+    struct async_task* done = loop->done_head;
+    loop->done_head = NULL;
+    loop->done_tail = NULL;
+    pthread_mutex_unlock(&loop->done_mutex);
+    while (done != NULL) {
+        struct async_task* t = done;
+        done = t->next_ready;
+        resume(loop, t, finish);
+    }
+    int64_t now = async_now();
+    while (loop->timer_cnt > 0 && loop->timers[0]->due_ns <= now) {
+        resume(loop, timer_pop(loop), finish);
+    }
+}
+
+int64_t async_next_due( struct async_loop* loop ) {
+    if (loop->ready_head != NULL) {
+        return 0;
+    }
+    return loop->timer_cnt > 0 ? loop->timers[0]->due_ns : -1;
+}
+
+void async_wait( struct async_loop* loop, int64_t until_ns ) {
+    if (until_ns < 0) {
+        sem_wait(&loop->done_avail);
+    } else {
+        int64_t wait_ns = until_ns - async_now();
+        if (wait_ns <= 0) {
+            return;
+        }
+        //sem_timedwait only takes CLOCK_REALTIME deadlines
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wait_ns / 1000000000;
+        deadline.tv_nsec += wait_ns % 1000000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&loop->done_avail, &deadline) != 0) {
+            if (errno == ETIMEDOUT) {
+                return;
+            }
+        }
+    }
+    //The next async_run() takes every completed task at once, drop their other posts
+    while (sem_trywait(&loop->done_avail) == 0);
+}
@@ -0,0 +1,139 @@
+/*
+ *  Event loop for the asynchronous worker engine of the bank server.
+ *
+ *  Requests run as stackless state machines (struct async_task). A step
+ *  function advances a task as far as it can and then either finishes
+ *  it or starts exactly one operation that suspends it:
+ *
+ *  async_read()   read an account, the value is in task->value when
+ *                 the step function runs again
+ *  async_write()  write an account
+ *  async_sleep()  wait, e.g. before retrying a lock that was taken
+ *
+ *  Each worker thread owns one loop and interleaves every task it has
+ *  in flight. Reads and writes are handed to a small pool of I/O threads
+ *  started with async_io_start(), which call the real, blocking
+ *  read_account() and write_account() of Bank.c and report completion
+ *  back to the loop of the task. A worker therefore keeps as many
+ *  storage accesses going as there are I/O threads, without blocking
+ *  on any of them itself.
+ */
+
+#ifndef ASYNC_ENGINE_H
+#define ASYNC_ENGINE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+//Step function results
+#define ASYNC_DONE 0
+#define ASYNC_SUSPENDED 1
+
+#define ASYNC_OP_NONE 0
+#define ASYNC_OP_READ 1
+#define ASYNC_OP_WRITE 2
+#define ASYNC_OP_SLEEP 3
+
+struct async_loop;
+
+struct async_task {
+    //Advances the task, returns ASYNC_DONE or ASYNC_SUSPENDED after starting one operation
+    int (*step)(struct async_task* t);
+    //Where the step function continues, owned by the step function
+    int state;
+    //Result of the last async_read()
+    int value;
+
+    //--------------Owned by the loop--------------
+    struct async_loop* loop;
+    int op;
+    int op_id;
+    int op_value;
+    int64_t due_ns;
+    //Link in the ready list, the I/O queue or the completed list, one at a time
+    struct async_task* next_ready;
+    //Links in the list of every task in flight on the loop
+    struct async_task* next_task;
+    struct async_task* prev_task;
+};
+
+struct async_loop {
+    //Min-heap of sleeping tasks ordered by due_ns
+    struct async_task** timers;
+    int timer_cnt;
+    int timer_cap;
+    //Tasks started but not run yet
+    struct async_task* ready_head;
+    struct async_task* ready_tail;
+    //Tasks whose read or write an I/O thread finished, guarded by done_mutex
+    pthread_mutex_t done_mutex;
+    struct async_task* done_head;
+    struct async_task* done_tail;
+    //Posted once per completed read or write
+    sem_t done_avail;
+    //Tasks started and not finished, and how many
+    struct async_task* tasks;
+    int inflight;
+};
+
+/*
+ *  Current CLOCK_MONOTONIC time in nanoseconds
+ */
+int64_t async_now();
+
+/*
+ *  Start the I/O threads shared by every loop
+ *  Input:  int threads - Number of storage accesses that may run at once
+ *  Return:  1 if succeeded, 0 if no thread could be started
+ */
+int async_io_start( int threads );
+
+/*
+ *  Stop the I/O threads once every loop is done with them
+ */
+void async_io_stop();
+
+void async_loop_init( struct async_loop* loop );
+
+void async_loop_free( struct async_loop* loop );
+
+/*
+ *  Add a new task, its step function first runs from the next async_run()
+ */
+void async_start( struct async_loop* loop, struct async_task* t );
+
+/*
+ *  Suspend a task on a storage read of account id, returns ASYNC_SUSPENDED
+ */
+int async_read( struct async_loop* loop, struct async_task* t, int id );
+
+/*
+ *  Suspend a task on a storage write of value to account id, returns ASYNC_SUSPENDED
+ */
+int async_write( struct async_loop* loop, struct async_task* t, int id, int value );
+
+/*
+ *  Suspend a task for nsec nanoseconds, returns ASYNC_SUSPENDED
+ */
+int async_sleep( struct async_loop* loop, struct async_task* t, int64_t nsec );
+
+/*
+ *  Run every task that is ready, including those whose operation completed
+ *  Input:  void (*finish)(struct async_task*) - Called for each task that is done
+ */
+void async_run( struct async_loop* loop, void (*finish)(struct async_task*) );
+
+/*
+ *  When the earliest sleeping task becomes ready
+ *  Return:  CLOCK_MONOTONIC time in nanoseconds, -1 if no task is sleeping
+ */
+int64_t async_next_due( struct async_loop* loop );
+
+/*
+ *  Block until a read or write of the loop completes or until the deadline
+ *  Input:  int64_t until_ns - CLOCK_MONOTONIC deadline in nanoseconds, -1 for none
+ */
+void async_wait( struct async_loop* loop, int64_t until_ns );
+
+#endif
@@ -1,21 +1,172 @@
+//Bank server. Built as appserver with one lock per account (ACCT_LOCK_* picks the lock),
+//or with -DBANK_LOCK_COARSE as appserver-coarse where one bank_mutex covers every account
+//and requests may run through flat combining on it.
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include "Bank.h"
+#include "Affinity.h"
+#include "Account.h"
+#include "ReqTrace.h"
+#include "Fenwick.h"
+#include "Ranking.h"
+#include "Probes.h"
+#include "ResultLog.h"
+#ifdef BANK_SIM
+#include "BankSim.h"
+#else
+#include "AsyncEngine.h"
+#endif
 
-#define MAX_REQ_LEN 250
+//Longest token kept from a request line, account IDs and amounts are much shorter
+#define MAX_TOKEN_LEN 32
+
+//Request lanes: cheap single-account CHECKs get their own latency class so they
+//are not stuck in FIFO order behind multi-pair TRANS requests
+#define NUM_LANES 2
+#define LANE_FAST 0
+#define LANE_BULK 1
+//Default number of fast lane requests served for every bulk lane request
+#define DEFAULT_FAST_WEIGHT 4
+//Default age (in microseconds) after which a waiting request is served regardless of its lane weight
+#define DEFAULT_AGING_USEC 100000
+//Default queue wait (in microseconds) above which the worker pool grows by one thread
+#define DEFAULT_TARGET_WAIT_USEC 20000
+//Default time (in microseconds) an idle worker above the minimum waits before retiring
+#define DEFAULT_IDLE_TIMEOUT_USEC 2000000
+//Most requests a worker pulls from a lane to run as one batch
+#define MAX_COALESCE 32
+#define DEFAULT_COALESCE 8
+
+//Read-only requests answered from the committed balances
+#define QUERY_NONE 0
+#define QUERY_AUDIT 1
+#define QUERY_SUM 2
+#define QUERY_TOP 3
+#define QUERY_BOTTOM 4
+//Randomized exponential backoff between try-lock rounds, in nanoseconds
+#define LOCK_BACKOFF_MIN_NSEC 1000
+#define LOCK_BACKOFF_MAX_NSEC 1000000
+#define DEFAULT_LOCK_RETRIES 3
+//Accounts covered by one block lock when range locks are on
+#define LOCK_BLOCK_SIZE 64
+//TRANS requests with more pairs than this are not coalesced, comparing them is too costly
+#define MAX_COALESCE_PAIRS 64
+
+//Kinds of lock a TRANS batch takes
+#define STEP_ACCOUNT 0
+#define STEP_BLOCK_SHARED 1
+#define STEP_BLOCK_EXCL 2
+
+//Optimistic passes an AUDIT or SUM makes before holding new commits back
+#define AUDIT_OPTIMISTIC_TRIES 8
+//How many times a combiner drains the publication list before letting go of bank_mutex
+#define COMBINE_PASSES 4
+//Most requests the coarse server runs in one bank_mutex hold with --drain
+#define MAX_DRAIN 64
+
+//Worker engines: one request batch per thread at a time, or many requests per thread
+#define ENGINE_THREADS 0
+#define ENGINE_ASYNC 1
+#define DEFAULT_INFLIGHT 256
+//How long an async task waits before trying a taken account lock again
+#define ASYNC_LOCK_POLL_NSEC 200000
+//How often an async worker with tasks in flight looks for new requests
+#define ASYNC_JOB_POLL_NSEC 200000
+#define DEFAULT_IO_THREADS 16
+//Where async_step continues a task
+#define ASYNC_STATE_LOCK 0
+#define ASYNC_STATE_READ 1
+#define ASYNC_STATE_WRITE 2
+
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
 
 int quit_cmd_received = 0;
+int num_threads = 0;
+int min_threads = 0;
+int max_threads = 0;
+long target_wait_usec = DEFAULT_TARGET_WAIT_USEC;
+long idle_timeout_usec = DEFAULT_IDLE_TIMEOUT_USEC;
+int coalesce_max = DEFAULT_COALESCE;
+int optimistic_isf = 1;
+//How long a TRANS batch may wait for its locks before it is requeued, 0 waits forever
+long lock_timeout_usec = 0;
+int lock_retries = DEFAULT_LOCK_RETRIES;
+//Take whole blocks of accounts with one lock when a TRANS covers all of them
+int range_locks = 0;
+//Release account locks once the new balances are installed, before they are written to storage
+int early_release = 0;
+int num_accounts = 0;
+int pin_mode = PIN_NONE;
+char* pin_cpus = NULL;
+int numa_mode = NUMA_NONE;
+int engine = ENGINE_THREADS;
+//Most requests an async worker keeps in flight
+int async_inflight = DEFAULT_INFLIGHT;
+//Threads making the storage calls of every async worker
+int io_thread_count = DEFAULT_IO_THREADS;
+//Binary trace of every incoming request, see ReqTrace.h
+char* trace_path = NULL;
+struct trace_file trace;
+int fast_lane_weight = DEFAULT_FAST_WEIGHT;
+long aging_usec = DEFAULT_AGING_USEC;
 sem_t* queue_mutex;
-sem_t* acc_mutex;
+//Counts requests sitting in the lanes so idle workers can block instead of spinning
+sem_t* jobs_avail;
+//One cache line per account holding its lock and committed balance
+struct account* accounts;
+//One reader/writer lock per LOCK_BLOCK_SIZE accounts, only used with range locks
+pthread_rwlock_t* block_locks;
+//Protects the worker pool counters
+sem_t* pool_mutex;
+//Posted by the last worker to exit after END
+sem_t* pool_done;
+//Commit generation gate for AUDIT and SUM: commit_gen counts batches that started installing
+//balances, writers_active the ones still doing so, audit_gate holds new ones back
+uint64_t commit_gen = 0;
+int writers_active = 0;
+int audit_gate = 0;
+//Only one query at a time may close the gate
+sem_t* audit_mutex;
+//Range sums over the committed balances, updated in the commit section
+struct fenwick balance_index;
+//Storage write state per account for early lock release, see persist_account
+struct durable_state* durability;
+//Guards the durable versions and wakes results waiting for them
+pthread_mutex_t durable_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+//Accounts ordered by committed balance for TOP and BOTTOM, guarded by ranking_mutex. Commits
+//only keep it up to date once ranking_on was set by the first TOP or BOTTOM.
+struct ranking balance_ranking;
+sem_t* ranking_mutex;
+int ranking_on = 0;
+#ifdef BANK_LOCK_COARSE
+//The one lock every request runs under
+sem_t* bank_mutex;
+//Run batches through flat combining instead of one bank_mutex hold per batch
+int combine = 0;
+//Batches published for the next combiner, newest first
+struct publication* combine_list = NULL;
+//Most requests one bank_mutex hold runs, 1 runs a single batch per hold
+int drain_max = 1;
+#endif
 FILE* output;
+//Write fixed-size records of ResultLog.h instead of text lines
+int binary_log = 0;
+//Storage array from Bank.c, only used to apply a NUMA policy to it
+extern int* BANK_accounts;
 
-struct queue* q;
+struct queue* lanes;
+//How many fast lane requests have been served since the last bulk lane request
+int fast_served = 0;
 
 struct transaction {
     int acc_id;
@@ -35,6 +186,19 @@ struct request {
     struct timeval end;
     //Is this an exit command?
     int exit;
+    //QUERY_AUDIT or QUERY_SUM for read-only queries, QUERY_NONE otherwise
+    int query;
+    //Account range of a SUM
+    int range_lo;
+    int range_hi;
+    //Number of accounts a TOP or BOTTOM lists
+    int top_k;
+    //How many times the request gave up waiting for its locks
+    int retries;
+#ifdef BANK_SIM
+    //Virtual arrival time in the storage simulation
+    int64_t sim_arrival;
+#endif
 };
 
 struct queue {
@@ -43,7 +207,90 @@ struct queue {
     int num_jobs;
 };
 
-void queue_add(struct request* req) {
+//Working copy of one account while a batch of TRANS requests runs
+struct batch_acct {
+    int acc_id;
+    //Has the balance been read from storage yet?
+    int loaded;
+    //Does the balance need to be written back?
+    int dirty;
+    int balance;
+    //Account version the batch read or installed, results wait for it to be durable with early release
+    uint32_t seen;
+    //Queue node for the account lock while the batch holds it
+    struct acct_lock_node node;
+};
+
+//With early lock release an installed balance reaches storage after the account lock is
+//released. Writers of one account take turns on write_lock, and version is the account
+//version (see Account.h) whose balance storage holds.
+struct durable_state {
+    pthread_mutex_t write_lock;
+    uint32_t version;
+};
+
+//One lock a batch has to take, in the order they are taken
+struct lock_step {
+    //STEP_ACCOUNT, STEP_BLOCK_SHARED or STEP_BLOCK_EXCL
+    int kind;
+    //Index into the batch accounts for STEP_ACCOUNT, block number otherwise
+    int index;
+};
+
+//A batch waiting in the flat combining list, lives on the stack of the worker that published it
+struct publication {
+    struct request** batch;
+    int cnt;
+    //Set by the combiner once the batch has run
+    int done;
+    struct publication* next;
+} __attribute__((aligned(64)));
+
+struct pool_stats {
+    //Workers currently running
+    int live;
+    int peak;
+    int started;
+    int retired;
+};
+
+struct pool_stats pool;
+
+//Counters reported when the server exits
+struct server_stats {
+    //TRANS requests rejected with ISF before taking any lock
+    long early_isf;
+    //TRANS requests requeued after their lock wait deadline passed
+    long lock_retries;
+    //TRANS requests that ran out of retries and got a TIMEOUT result
+    long lock_timeouts;
+    long audits;
+    long sums;
+    long rankings;
+    //Optimistic AUDIT and SUM passes that overlapped a commit
+    long query_retries;
+    //AUDIT and SUM requests that had to hold commits back
+    long query_gated;
+    //Times an async task found an account lock taken and slept
+    long async_lock_waits;
+    //bank_mutex holds by a combiner and the batches they ran
+    long combine_holds;
+    long combined_batches;
+    //bank_mutex holds that drained extra requests, and the requests they ran
+    long drain_holds;
+    long drained_requests;
+    //Early release reads served from an installed balance that was not in storage yet
+    long pending_reads;
+    //Early release writes skipped since a newer balance of the account was written first
+    long superseded_writes;
+    //Results that waited for an earlier request's write to reach storage
+    long durable_waits;
+};
+
+struct server_stats stats;
+
+void queue_add(struct queue* q, struct request* req) {
+    req->prev = NULL;
     //Queue is empty
     if (q->num_jobs == 0) {
         q->head = req;
@@ -58,7 +305,7 @@ void queue_add(struct request* req) {
     }
 }
 
-struct request* queue_pop() {
+struct request* queue_pop(struct queue* q) {
     if (q->head == NULL) {
         return NULL;
     } else {
@@ -69,241 +316,1704 @@ struct request* queue_pop() {
     }
 }
 
-void swap(struct transaction* left, struct transaction* right) {
-    struct transaction temp = *left;
-    *left = *right;
-    *right = temp;
+long usec_since(struct timeval* then, struct timeval* now) {
+    return (now->tv_sec - then->tv_sec) * 1000000L + (now->tv_usec - then->tv_usec);
+}
+
+//Pick the next request from the lanes, must be called while holding queue_mutex.
+//The fast lane gets fast_lane_weight turns for every bulk lane turn, but a lane head
+//that has waited longer than aging_usec is always served first so neither lane starves.
+struct request* lanes_pop() {
+    struct queue* fast = &lanes[LANE_FAST];
+    struct queue* bulk = &lanes[LANE_BULK];
+    struct timeval now;
+
+    if (fast->num_jobs == 0 && bulk->num_jobs == 0) {
+        return NULL;
+    }
+    if (fast->num_jobs == 0) {
+        fast_served = 0;
+        return queue_pop(bulk);
+    }
+    if (bulk->num_jobs == 0) {
+        return queue_pop(fast);
+    }
+
+    //Both lanes have work, serve the oldest overdue head first
+    gettimeofday(&now, NULL);
+    long fast_age = usec_since(&fast->head->start, &now);
+    long bulk_age = usec_since(&bulk->head->start, &now);
+    if (bulk_age >= aging_usec && bulk_age >= fast_age) {
+        fast_served = 0;
+        return queue_pop(bulk);
+    }
+    if (fast_age >= aging_usec) {
+        fast_served++;
+        return queue_pop(fast);
+    }
+
+    //Otherwise follow the lane weights
+    if (fast_served < fast_lane_weight) {
+        fast_served++;
+        return queue_pop(fast);
+    }
+    fast_served = 0;
+    return queue_pop(bulk);
+}
+
+int compare_transactions(const void* a, const void* b) {
+    return ((struct transaction*)a)->acc_id - ((struct transaction*)b)->acc_id;
 }
 
 void sort_transactions(struct transaction* trans_arr, int n) {
-    int i, j;
-    int swapped;
-    for (i = 0; i < n - 1; i++) {
-        swapped = 0;
-        for (j = 0; j < n - i - 1; j++) {
-            if (trans_arr[j].acc_id > trans_arr[j + 1].acc_id) {
-                swap(&trans_arr[j], &trans_arr[j + 1]);
-                swapped = 1;
+    qsort(trans_arr, n, sizeof(struct transaction), compare_transactions);
+}
+
+//--------------Worker pool code--------------
+void* process_request(void* arg);
+void* async_worker(void* arg);
+
+//Start one more worker, must be called while holding pool_mutex
+void pool_spawn() {
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    //Workers are detached since the pool shrinks on its own, main() waits on pool_done instead
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    //Hand each worker its index so it can pick its CPU
+    void* (*worker)(void*) = process_request;
+#ifndef BANK_SIM
+    if (engine == ENGINE_ASYNC) {
+        worker = async_worker;
+    }
+#endif
+    if (pthread_create(&thread, &attr, worker, (void*)(long)pool.started) == 0) {
+        pool.live++;
+        pool.started++;
+        if (pool.live > pool.peak) {
+            pool.peak = pool.live;
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+//Grow the pool if the request we just dequeued waited longer than the target
+void pool_grow(struct request* req) {
+    struct timeval now;
+
+    if (pool.live >= max_threads) {
+        return;
+    }
+    gettimeofday(&now, NULL);
+    if (usec_since(&req->start, &now) < target_wait_usec) {
+        return;
+    }
+    sem_wait(pool_mutex);
+    if (!quit_cmd_received && pool.live < max_threads) {
+        pool_spawn();
+    }
+    sem_post(pool_mutex);
+}
+
+//Called by a worker that timed out waiting for work. Returns 1 if the worker should exit.
+int pool_retire() {
+    int retire = 0;
+    sem_wait(pool_mutex);
+    if (pool.live > min_threads && !quit_cmd_received) {
+        pool.live--;
+        pool.retired++;
+        retire = 1;
+    }
+    sem_post(pool_mutex);
+    return retire;
+}
+
+//Called by a worker leaving after END
+void pool_exit() {
+    sem_wait(pool_mutex);
+    int last = --pool.live == 0;
+    sem_post(pool_mutex);
+    if (last) {
+        sem_post(pool_done);
+    }
+}
+
+//Wait for a request to be posted. Returns 0 if the worker sat idle for idle_timeout_usec.
+int wait_for_job() {
+    struct timespec deadline;
+
+    //A fixed size pool never retires workers so it can wait forever
+    if (min_threads == max_threads) {
+        sem_wait(jobs_avail);
+        return 1;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += idle_timeout_usec / 1000000;
+    deadline.tv_nsec += (idle_timeout_usec % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while (sem_timedwait(jobs_avail, &deadline) != 0) {
+        if (errno == ETIMEDOUT) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//--------------Request execution code--------------
+//Start and end times written to a result line
+void result_times(struct request* req, struct timeval* start, struct timeval* end) {
+#ifdef BANK_SIM
+    //Log modelled times so the result analyzers see what the real storage would have done
+    sim_timeval(req->sim_arrival, start);
+    sim_timeval(sim_complete(req->sim_arrival), end);
+#else
+    *start = req->start;
+    gettimeofday(end, NULL);
+#endif
+}
+
+void fill_record(struct result_record* rec, int request_id, int kind, int64_t value, struct timeval* start, struct timeval* end) {
+    rec->start_us = (int64_t)start->tv_sec * 1000000 + start->tv_usec;
+    rec->end_us = (int64_t)end->tv_sec * 1000000 + end->tv_usec;
+    rec->value = value;
+    rec->request_id = request_id;
+    rec->kind = kind;
+    memset(rec->reserved, 0, sizeof(rec->reserved));
+}
+
+//Write the result line for a request, value is the balance for BAL, the account for ISF
+//and the total for AUDIT and SUM
+void log_result(struct request* req, int result, long value) {
+    struct timeval start, end;
+    result_times(req, &start, &end);
+    if (result == RESULT_ISF) {
+        BANK_PROBE2(isf, req->request_id, value);
+    }
+    if (binary_log) {
+        struct result_record rec;
+        fill_record(&rec, req->request_id, result, value, &start, &end);
+        fwrite(&rec, sizeof(rec), 1, output);
+    } else if (result == RESULT_BAL) {
+        fprintf(output, "%0d BAL %0ld TIME %ld.%06ld %ld.%06ld\n", req->request_id, value, start.tv_sec, start.tv_usec, end.tv_sec, end.tv_usec);
+    } else if (result == RESULT_ISF) {
+        fprintf(output, "%0d ISF %0ld TIME %ld.%06ld %ld.%06ld\n", req->request_id, value, start.tv_sec, start.tv_usec, end.tv_sec, end.tv_usec);
+    } else if (result == RESULT_AUDIT) {
+        fprintf(output, "%0d AUDIT %0ld TIME %ld.%06ld %ld.%06ld\n", req->request_id, value, start.tv_sec, start.tv_usec, end.tv_sec, end.tv_usec);
+    } else if (result == RESULT_SUM) {
+        fprintf(output, "%0d SUM %0ld TIME %ld.%06ld %ld.%06ld\n", req->request_id, value, start.tv_sec, start.tv_usec, end.tv_sec, end.tv_usec);
+    } else if (result == RESULT_TIMEOUT) {
+        fprintf(output, "%0d TIMEOUT TIME %ld.%06ld %ld.%06ld\n", req->request_id, start.tv_sec, start.tv_usec, end.tv_sec, end.tv_usec);
+    } else {
+        fprintf(output, "%0d OK TIME %ld.%06ld %ld.%06ld\n", req->request_id, start.tv_sec, start.tv_usec, end.tv_sec, end.tv_usec);
+    }
+    BANK_PROBE2(result, req->request_id, result);
+}
+
+//Write the result line of a TOP or BOTTOM: the number of accounts, then account:balance pairs
+void log_ranking(struct request* req, char* name, int* ids, int64_t* balances, int cnt) {
+    struct timeval start, end;
+    int kind = req->query == QUERY_TOP ? RESULT_TOP : RESULT_BOTTOM;
+
+    if (binary_log) {
+        //One fwrite so the entries stay right behind their TOP or BOTTOM record
+        struct result_record* recs = malloc((cnt + 1) * sizeof(struct result_record));
+        result_times(req, &start, &end);
+        fill_record(&recs[0], req->request_id, kind, cnt, &start, &end);
+        for (int i = 0; i < cnt; i++) {
+            fill_record(&recs[i + 1], ids[i], RESULT_RANK_ENTRY, balances[i], &start, &end);
+        }
+        fwrite(recs, sizeof(struct result_record), cnt + 1, output);
+        BANK_PROBE2(result, req->request_id, kind);
+        free(recs);
+        return;
+    }
+    char* list = malloc(cnt * 32 + 1);
+    int len = 0;
+    list[0] = '\0';
+    for (int i = 0; i < cnt; i++) {
+        len += sprintf(list + len, " %d:%ld", ids[i], (long)balances[i]);
+    }
+    result_times(req, &start, &end);
+    fprintf(output, "%0d %s %0d%s TIME %ld.%06ld %ld.%06ld\n", req->request_id, name, cnt, list, start.tv_sec, start.tv_usec, end.tv_sec, end.tv_usec);
+    BANK_PROBE2(result, req->request_id, kind);
+    free(list);
+}
+
+void free_request(struct request* req) {
+    free(req->trans_list);
+    free(req);
+}
+
+//Does req touch any account already used by the batch?
+int shares_account(struct request** batch, int cnt, struct request* req) {
+    for (int b = 0; b < cnt; b++) {
+        for (int i = 0; i < batch[b]->trans_cnt; i++) {
+            for (int j = 0; j < req->trans_cnt; j++) {
+                if (batch[b]->trans_list[i].acc_id == req->trans_list[j].acc_id) {
+                    return 1;
+                }
             }
         }
+    }
+    return 0;
+}
+
+//Coalescing pass, must be called while holding queue_mutex. Pulls the requests queued
+//right behind first in its lane that can share its storage accesses: CHECKs of the same
+//account, or TRANS requests touching an account the batch already uses.
+int lanes_pop_batch(struct request* first, struct request** batch) {
+    int cnt = 1;
+    batch[0] = first;
+    if (first->exit) {
+        return cnt;
+    }
 
-        // If no two elements were swapped by inner loop,
-        // then break
-        if (swapped == 0)
+    struct queue* lane = &lanes[first->balchk_id >= 0 ? LANE_FAST : LANE_BULK];
+    while (cnt < coalesce_max && lane->num_jobs > 0) {
+        struct request* next = lane->head;
+        if (first->balchk_id >= 0 && next->balchk_id != first->balchk_id) {
             break;
+        }
+        if (first->balchk_id < 0 && (next->exit || next->trans_cnt > MAX_COALESCE_PAIRS ||
+                                     first->trans_cnt > MAX_COALESCE_PAIRS || !shares_account(batch, cnt, next))) {
+            break;
+        }
+        batch[cnt++] = queue_pop(lane);
+        //Keep the job count in step, a missed post only causes a spurious wake up
+        sem_trywait(jobs_avail);
     }
+    return cnt;
 }
 
-//--------------Worker thread code--------------
-void* process_request() {
-    struct request* req;
-    struct timeval end;
+//Storage accesses of Bank.c wrapped in their tracepoints
+int storage_read(int acc_id) {
+    BANK_PROBE1(read_start, acc_id);
+    int balance = read_account(acc_id);
+    BANK_PROBE2(read_end, acc_id, balance);
+    return balance;
+}
 
-    while(1) {
-        int insufficient = 0;
+void storage_write(int acc_id, int balance) {
+    BANK_PROBE2(write_start, acc_id, balance);
+    write_account(acc_id, balance);
+    BANK_PROBE1(write_end, acc_id);
+}
+
+//--------------Early lock release code--------------
+//Has storage caught up with account version v? Versions count up and may wrap.
+int is_durable(int acc_id, uint32_t v) {
+    return (int32_t)(__atomic_load_n(&durability[acc_id - 1].version, __ATOMIC_ACQUIRE) - v) >= 0;
+}
+
+//Read an account while holding its lock. With early release an installed balance may
+//still be on its way to storage, then the in-memory copy is the current one.
+//Output: uint32_t* seen - The account version read
+int load_balance(int acc_id, uint32_t* seen) {
+    if (!early_release) {
+        *seen = 0;
+        return storage_read(acc_id);
+    }
+    struct account* acct = &accounts[acc_id - 1];
+    *seen = __atomic_load_n(&acct->version, __ATOMIC_ACQUIRE);
+    if (!is_durable(acc_id, *seen)) {
+        __atomic_fetch_add(&stats.pending_reads, 1, __ATOMIC_RELAXED);
+        return (int)__atomic_load_n(&acct->balance, __ATOMIC_RELAXED);
+    }
+    return storage_read(acc_id);
+}
+
+//Write the latest installed balance of an account to storage, after its lock was released.
+//If a later batch already wrote a newer balance there is nothing left to do, writes of one
+//account are serialized so storage never goes back to an older balance.
+void persist_account(int acc_id) {
+    struct account* acct = &accounts[acc_id - 1];
+    struct durable_state* d = &durability[acc_id - 1];
+    int64_t balance;
+    uint32_t v;
+
+    pthread_mutex_lock(&d->write_lock);
+    do {
+        v = __atomic_load_n(&acct->version, __ATOMIC_ACQUIRE);
+    } while (!account_peek(acct, &balance) || __atomic_load_n(&acct->version, __ATOMIC_ACQUIRE) != v);
+    if (is_durable(acc_id, v)) {
+        __atomic_fetch_add(&stats.superseded_writes, 1, __ATOMIC_RELAXED);
+    } else {
+        storage_write(acc_id, (int)balance);
+        pthread_mutex_lock(&durable_mutex);
+        __atomic_store_n(&d->version, v, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&durable_cond);
+        pthread_mutex_unlock(&durable_mutex);
+    }
+    pthread_mutex_unlock(&d->write_lock);
+}
+
+//Hold a result back until the account version it depends on is in storage, so no result
+//is reported before the requests it read from
+void wait_durable(int acc_id, uint32_t v) {
+    if (!early_release || is_durable(acc_id, v)) {
+        return;
+    }
+    __atomic_fetch_add(&stats.durable_waits, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&durable_mutex);
+    while (!is_durable(acc_id, v)) {
+        pthread_cond_wait(&durable_cond, &durable_mutex);
+    }
+    pthread_mutex_unlock(&durable_mutex);
+}
+
+//Answer every CHECK in the batch with a single read, they are all for the same account
+void run_check_batch(struct request** batch, int cnt) {
+    int acc_id = batch[0]->balchk_id;
+
+#ifdef BANK_LOCK_COARSE
+    //The caller holds bank_mutex
+    BANK_PROBE2(lock_acquired, batch[0]->request_id, 0);
+    int balance = storage_read(acc_id);
+#else
+    struct acct_lock_node node;
+    if (range_locks) {
+        pthread_rwlock_rdlock(&block_locks[(acc_id - 1) / LOCK_BLOCK_SIZE]);
+    }
+    uint32_t seen;
+    acct_lock_acquire(&accounts[acc_id - 1].lock, &node);
+    BANK_PROBE2(lock_acquired, batch[0]->request_id, range_locks ? 2 : 1);
+    int balance = load_balance(acc_id, &seen);
+    acct_lock_release(&accounts[acc_id - 1].lock, &node);
+    if (range_locks) {
+        pthread_rwlock_unlock(&block_locks[(acc_id - 1) / LOCK_BLOCK_SIZE]);
+    }
+    wait_durable(acc_id, seen);
+#endif
+
+    for (int b = 0; b < cnt; b++) {
+        log_result(batch[b], RESULT_BAL, balance);
+        free_request(batch[b]);
+    }
+}
 
-        //Start by acquiring a lock on the queue to grab a request
-//        printf("THREAD: Trying to acquire lock\n");
+//Nonzero if one of the cnt requests credits acc_id
+int credits_account(struct request** batch, int cnt, int acc_id) {
+    for (int b = 0; b < cnt; b++) {
+        for (int i = 0; i < batch[b]->trans_cnt; i++) {
+            if (batch[b]->trans_list[i].acc_id == acc_id && batch[b]->trans_list[i].amount > 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//Optimistic ISF check done before taking any account lock. Returns the account
+//whose committed balance clearly cannot cover its withdrawal, or 0 if the request
+//may succeed or a balance was being changed while we looked at it. The ahead
+//requests run first in the same batch, an account they credit is not judged by
+//its committed balance.
+int find_early_isf(struct request* req, struct request** ahead, int ahead_cnt) {
+    for (int trans = 0; trans < req->trans_cnt; trans++) {
+        int64_t balance;
+        if (req->trans_list[trans].amount >= 0) {
+            continue;
+        }
+        if (account_peek(&accounts[req->trans_list[trans].acc_id - 1], &balance) &&
+            balance + req->trans_list[trans].amount < 0 &&
+            !credits_account(ahead, ahead_cnt, req->trans_list[trans].acc_id)) {
+            return req->trans_list[trans].acc_id;
+        }
+    }
+    return 0;
+}
+
+//Log the ISF found by find_early_isf and free the request
+void reject_early(struct request* req, int isf_acc) {
+    //The balance that was too low may not be in storage yet with early release
+    wait_durable(isf_acc, __atomic_load_n(&accounts[isf_acc - 1].version, __ATOMIC_ACQUIRE));
+    log_result(req, RESULT_ISF, isf_acc);
+    __atomic_fetch_add(&stats.early_isf, 1, __ATOMIC_RELAXED);
+    free_request(req);
+}
+
+//Reject the requests of a batch that fail the optimistic ISF check without locking
+//anything, and return how many requests are left to run
+int reject_early_isf(struct request** batch, int cnt) {
+    int left = 0;
+    for (int b = 0; b < cnt; b++) {
+        int isf_acc = find_early_isf(batch[b], batch, left);
+        if (isf_acc != 0) {
+            reject_early(batch[b], isf_acc);
+        } else {
+            batch[left++] = batch[b];
+        }
+    }
+    return left;
+}
+
+//Turn the sorted batch accounts into the list of locks to take. Without range locks this
+//is one step per account. With them, accounts are grouped into blocks of LOCK_BLOCK_SIZE:
+//a block the batch covers completely is locked exclusively as a whole, any other block is
+//locked shared and followed by its account locks. Blocks are visited in ascending order so
+//every locker still follows one global lock order. Returns the number of steps.
+int plan_locks(struct batch_acct* accts, int n, struct lock_step* steps) {
+    int cnt = 0;
+
+#ifdef BANK_LOCK_COARSE
+    //The caller holds bank_mutex, which covers every account
+    return cnt;
+#endif
+
+    if (!range_locks) {
+        for (int i = 0; i < n; i++) {
+            steps[cnt].kind = STEP_ACCOUNT;
+            steps[cnt++].index = i;
+        }
+        return cnt;
+    }
+
+    int i = 0;
+    while (i < n) {
+        int block = (accts[i].acc_id - 1) / LOCK_BLOCK_SIZE;
+        int block_len = MIN(LOCK_BLOCK_SIZE, num_accounts - block * LOCK_BLOCK_SIZE);
+        int j = i;
+        //The accounts are sorted and unique, so counting them is enough to spot a full block
+        while (j < n && (accts[j].acc_id - 1) / LOCK_BLOCK_SIZE == block) {
+            j++;
+        }
+        steps[cnt].index = block;
+        if (j - i == block_len) {
+            steps[cnt++].kind = STEP_BLOCK_EXCL;
+        } else {
+            steps[cnt++].kind = STEP_BLOCK_SHARED;
+            for (int k = i; k < j; k++) {
+                steps[cnt].kind = STEP_ACCOUNT;
+                steps[cnt++].index = k;
+            }
+        }
+        i = j;
+    }
+    return cnt;
+}
+
+//Take the lock of one step, only trying if try is set. Returns 1 if the lock is held.
+int step_lock(struct lock_step* step, struct batch_acct* accts, int try) {
+    if (step->kind == STEP_ACCOUNT) {
+        struct batch_acct* a = &accts[step->index];
+        if (try) {
+            return acct_lock_try(&accounts[a->acc_id - 1].lock, &a->node);
+        }
+        acct_lock_acquire(&accounts[a->acc_id - 1].lock, &a->node);
+        return 1;
+    }
+    pthread_rwlock_t* block = &block_locks[step->index];
+    if (step->kind == STEP_BLOCK_EXCL) {
+        return try ? pthread_rwlock_trywrlock(block) == 0 : pthread_rwlock_wrlock(block) == 0;
+    }
+    return try ? pthread_rwlock_tryrdlock(block) == 0 : pthread_rwlock_rdlock(block) == 0;
+}
+
+void step_unlock(struct lock_step* step, struct batch_acct* accts) {
+    if (step->kind == STEP_ACCOUNT) {
+        acct_lock_release(&accounts[accts[step->index].acc_id - 1].lock, &accts[step->index].node);
+    } else {
+        pthread_rwlock_unlock(&block_locks[step->index]);
+    }
+}
+
+//Release the steps in reverse order
+void unlock_steps(struct lock_step* steps, int cnt, struct batch_acct* accts) {
+    while (cnt-- > 0) {
+        step_unlock(&steps[cnt], accts);
+    }
+}
+
+//Take every lock in the plan in order. Without a lock timeout this blocks like before.
+//With one, each lock is tried with randomized exponential backoff, and once the deadline
+//passes everything taken so far is released and 0 is returned.
+int lock_steps(struct lock_step* steps, int cnt, struct batch_acct* accts) {
+    static __thread unsigned int seed = 0;
+    struct timeval deadline, now;
+
+    if (lock_timeout_usec <= 0) {
+        for (int i = 0; i < cnt; i++) {
+            step_lock(&steps[i], accts, 0);
+        }
+        return 1;
+    }
+
+    if (seed == 0) {
+        seed = (unsigned int)(long)&seed ^ (unsigned int)time(NULL);
+    }
+    gettimeofday(&deadline, NULL);
+    for (int i = 0; i < cnt; i++) {
+        long backoff = LOCK_BACKOFF_MIN_NSEC;
+        while (!step_lock(&steps[i], accts, 1)) {
+            gettimeofday(&now, NULL);
+            if (usec_since(&deadline, &now) >= lock_timeout_usec) {
+                unlock_steps(steps, i, accts);
+                return 0;
+            }
+            struct timespec pause = {0, rand_r(&seed) % backoff};
+            nanosleep(&pause, NULL);
+            if (backoff < LOCK_BACKOFF_MAX_NSEC) {
+                backoff *= 2;
+            }
+        }
+    }
+    return 1;
+}
+
+//A batch missed its lock deadline: put its requests back at the end of the bulk
+//lane, or give up on the ones that are out of retries
+void requeue_batch(struct request** batch, int cnt) {
+    for (int b = 0; b < cnt; b++) {
+        struct request* req = batch[b];
+        if (req->retries >= lock_retries) {
+            log_result(req, RESULT_TIMEOUT, 0);
+            __atomic_fetch_add(&stats.lock_timeouts, 1, __ATOMIC_RELAXED);
+            free_request(req);
+            continue;
+        }
+        req->retries++;
+        __atomic_fetch_add(&stats.lock_retries, 1, __ATOMIC_RELAXED);
         sem_wait(queue_mutex);
-//        printf("THREAD: Acquired lock\n");
-        if (q->num_jobs > 0) {
-            req = queue_pop();
+        queue_add(&lanes[LANE_BULK], req);
+        sem_post(queue_mutex);
+        sem_post(jobs_avail);
+    }
+}
+
+//--------------Audit code--------------
+//Start publishing the balances of a batch, waits while a query holds the gate closed
+void commit_enter() {
+    while (1) {
+        __atomic_add_fetch(&writers_active, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&audit_gate, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        //Step back so the waiting query sees no writers
+        __atomic_sub_fetch(&writers_active, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&audit_gate, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+    __atomic_add_fetch(&commit_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+void commit_exit() {
+    __atomic_sub_fetch(&writers_active, 1, __ATOMIC_SEQ_CST);
+}
+
+//Sum of the committed balances of accounts lo to hi. The records are a cache line apart so
+//there is no contiguous run for vector loads, four independent accumulators let the loads overlap.
+long sum_balances(int lo, int hi) {
+    int64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = lo - 1;
+    for (; i + 4 <= hi; i += 4) {
+        s0 += __atomic_load_n(&accounts[i].balance, __ATOMIC_RELAXED);
+        s1 += __atomic_load_n(&accounts[i + 1].balance, __ATOMIC_RELAXED);
+        s2 += __atomic_load_n(&accounts[i + 2].balance, __ATOMIC_RELAXED);
+        s3 += __atomic_load_n(&accounts[i + 3].balance, __ATOMIC_RELAXED);
+    }
+    for (; i < hi; i++) {
+        s0 += __atomic_load_n(&accounts[i].balance, __ATOMIC_RELAXED);
+    }
+    return s0 + s1 + s2 + s3;
+}
+
+//Range total from the Fenwick tree in O(log n)
+long sum_index(int lo, int hi) {
+    return fenwick_range(&balance_index, lo, hi);
+}
+
+//Run sum(lo, hi) at a point where no batch is half published. Tries a few optimistic
+//passes first, a pass is good if no commit started or was running during it.
+long consistent_total(long (*sum)(int, int), int lo, int hi) {
+    for (int attempt = 0; attempt < AUDIT_OPTIMISTIC_TRIES; attempt++) {
+        uint64_t gen = __atomic_load_n(&commit_gen, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&writers_active, __ATOMIC_SEQ_CST) == 0) {
+            long total = sum(lo, hi);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&writers_active, __ATOMIC_SEQ_CST) == 0 &&
+                __atomic_load_n(&commit_gen, __ATOMIC_SEQ_CST) == gen) {
+                return total;
+            }
+        }
+        __atomic_fetch_add(&stats.query_retries, 1, __ATOMIC_RELAXED);
+        sched_yield();
+    }
+
+    //Commits keep overlapping the sum, hold new ones back until the running ones are done
+    sem_wait(audit_mutex);
+    __atomic_store_n(&audit_gate, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&writers_active, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    long total = sum(lo, hi);
+    __atomic_store_n(&audit_gate, 0, __ATOMIC_SEQ_CST);
+    sem_post(audit_mutex);
+    __atomic_fetch_add(&stats.query_gated, 1, __ATOMIC_RELAXED);
+    return total;
+}
+
+//Build the ranking from the committed balances and have every later commit maintain it.
+//Runs behind the commit gate, so no commit is half way through while the balances are read.
+void enable_ranking() {
+    sem_wait(audit_mutex);
+    if (!__atomic_load_n(&ranking_on, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&audit_gate, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&writers_active, __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+        sem_wait(ranking_mutex);
+        for (int acc_id = 1; acc_id <= num_accounts; acc_id++) {
+            ranking_update(&balance_ranking, acc_id, __atomic_load_n(&accounts[acc_id - 1].balance, __ATOMIC_RELAXED));
+        }
+        sem_post(ranking_mutex);
+        __atomic_store_n(&ranking_on, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&audit_gate, 0, __ATOMIC_SEQ_CST);
+    }
+    sem_post(audit_mutex);
+}
+
+//With early release a query may have read balances that are not in storage yet. Hold its
+//result back until accounts lo to hi are durable at the versions installed now, which are
+//at least the ones the query saw.
+void wait_range_durable(int lo, int hi) {
+    if (!early_release) {
+        return;
+    }
+    for (int acc_id = lo; acc_id <= hi; acc_id++) {
+        wait_durable(acc_id, __atomic_load_n(&accounts[acc_id - 1].version, __ATOMIC_ACQUIRE));
+    }
+}
+
+//AUDIT sums every record directly, SUM uses the Fenwick tree and TOP/BOTTOM the ranking
+void run_query(struct request* req) {
+    if (req->query == QUERY_TOP || req->query == QUERY_BOTTOM) {
+        int* ids = malloc(req->top_k * sizeof(int));
+        int64_t* balances = malloc(req->top_k * sizeof(int64_t));
+        uint32_t* versions = malloc(req->top_k * sizeof(uint32_t));
+        if (!__atomic_load_n(&ranking_on, __ATOMIC_ACQUIRE)) {
+            enable_ranking();
+        }
+        //Batches update the ranking under the same lock, so the list never shows half a batch
+        sem_wait(ranking_mutex);
+        int cnt = ranking_top(&balance_ranking, req->top_k, req->query == QUERY_TOP, ids, balances);
+        //Batches install balances under the lock too, these are the versions the list shows
+        for (int i = 0; i < cnt; i++) {
+            versions[i] = __atomic_load_n(&accounts[ids[i] - 1].version, __ATOMIC_ACQUIRE);
+        }
+        sem_post(ranking_mutex);
+        for (int i = 0; i < cnt; i++) {
+            wait_durable(ids[i], versions[i]);
+        }
+        log_ranking(req, req->query == QUERY_TOP ? "TOP" : "BOTTOM", ids, balances, cnt);
+        __atomic_fetch_add(&stats.rankings, 1, __ATOMIC_RELAXED);
+        free(ids);
+        free(balances);
+        free(versions);
+    } else if (req->query == QUERY_AUDIT) {
+        long total = consistent_total(sum_balances, 1, num_accounts);
+        wait_range_durable(1, num_accounts);
+        log_result(req, RESULT_AUDIT, total);
+        __atomic_fetch_add(&stats.audits, 1, __ATOMIC_RELAXED);
+    } else {
+        long total = consistent_total(sum_index, req->range_lo, req->range_hi);
+        wait_range_durable(req->range_lo, req->range_hi);
+        log_result(req, RESULT_SUM, total);
+        __atomic_fetch_add(&stats.sums, 1, __ATOMIC_RELAXED);
+    }
+    free_request(req);
+}
+
+int compare_batch_acct(const void* a, const void* b) {
+    return ((struct batch_acct*)a)->acc_id - ((struct batch_acct*)b)->acc_id;
+}
+
+struct batch_acct* find_batch_acct(struct batch_acct* accts, int n, int acc_id) {
+    struct batch_acct key;
+    key.acc_id = acc_id;
+    return bsearch(&key, accts, n, sizeof(struct batch_acct), compare_batch_acct);
+}
+
+//Install the written balances of the dirty accounts in one commit section, the caller
+//holds their locks. request_id is the first request of the batch, for the commit probe.
+void publish_batch(int request_id, struct batch_acct* accts, int n) {
+    commit_enter();
+    //Set before the gate opened for this commit, or the ranking is rebuilt after it
+    int ranked = __atomic_load_n(&ranking_on, __ATOMIC_SEQ_CST);
+    if (ranked) {
+        sem_wait(ranking_mutex);
+    }
+    for (int i = 0; i < n; i++) {
+        if (accts[i].dirty) {
+            struct account* acct = &accounts[accts[i].acc_id - 1];
+            fenwick_add(&balance_index, accts[i].acc_id, accts[i].balance - acct->balance);
+            if (ranked) {
+                ranking_update(&balance_ranking, accts[i].acc_id, accts[i].balance);
+            }
+            account_install(acct, accts[i].balance);
+        }
+    }
+    if (ranked) {
+        sem_post(ranking_mutex);
+    }
+    commit_exit();
+    BANK_PROBE2(commit, request_id, n);
+}
+
+//Early release end of a TRANS batch: install the new balances, release the locks, then
+//write the balances to storage and report each result once everything it read or wrote
+//is durable
+void finish_early_release(struct request** batch, int cnt, int* ok, int* isf, struct batch_acct* accts, int n,
+                          struct lock_step* steps, int step_cnt) {
+    publish_batch(batch[0]->request_id, accts, n);
+    for (int i = 0; i < n; i++) {
+        if (accts[i].dirty) {
+            accts[i].seen = accounts[accts[i].acc_id - 1].version;
+        }
+    }
+    unlock_steps(steps, step_cnt, accts);
+
+    for (int i = 0; i < n; i++) {
+        if (accts[i].dirty) {
+            persist_account(accts[i].acc_id);
+        }
+    }
+    //Accounts the batch only read may still wait on the batch that wrote them
+    for (int i = 0; i < n; i++) {
+        if (accts[i].loaded) {
+            wait_durable(accts[i].acc_id, accts[i].seen);
+        }
+    }
+    for (int b = 0; b < cnt; b++) {
+        if (ok[b]) {
+            log_result(batch[b], RESULT_OK, 0);
         } else {
-            //Wait until we have a job available
-//            printf("THREAD: Waiting for transaction\n");
-            while (q->num_jobs == 0 && !quit_cmd_received);
-            if (quit_cmd_received && q->num_jobs == 0) {
-//                printf("THREAD: Returning!\n");
-                sem_post(queue_mutex);
+            log_result(batch[b], RESULT_ISF, isf[b]);
+        }
+    }
+}
+
+//Run the TRANS requests of a batch back to back as if they were executed one after
+//another. Every account is read at most once and written at most once for the whole
+//batch, and each request still gets its own OK or ISF line. Returns 0 if the batch
+//could not get its locks in time and was requeued, the requests are freed otherwise.
+int run_trans_batch(struct request** batch, int cnt) {
+    int total = 0;
+    int n = 0;
+    int ok[cnt];
+    //Account that caused ISF for each request that failed
+    int isf[cnt];
+
+    for (int b = 0; b < cnt; b++) {
+        total += batch[b]->trans_cnt;
+    }
+    struct batch_acct* accts = malloc((total > 0 ? total : 1) * sizeof(struct batch_acct));
+    for (int b = 0; b < cnt; b++) {
+        for (int i = 0; i < batch[b]->trans_cnt; i++) {
+            accts[n].acc_id = batch[b]->trans_list[i].acc_id;
+            accts[n].loaded = 0;
+            accts[n].dirty = 0;
+            n++;
+        }
+    }
+    //Sort the accounts and drop duplicates, locking in ascending order avoids deadlock
+    qsort(accts, n, sizeof(struct batch_acct), compare_batch_acct);
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || accts[unique - 1].acc_id != accts[i].acc_id) {
+            accts[unique++] = accts[i];
+        }
+    }
+    n = unique;
+
+    //First step is to acquire a lock on all accounts involved in the batch
+    struct lock_step* steps = malloc(2 * n * sizeof(struct lock_step) + 1);
+    int step_cnt = plan_locks(accts, n, steps);
+    if (!lock_steps(steps, step_cnt, accts)) {
+        free(steps);
+        free(accts);
+        requeue_batch(batch, cnt);
+        return 0;
+    }
+    BANK_PROBE2(lock_acquired, batch[0]->request_id, step_cnt);
+
+    for (int b = 0; b < cnt; b++) {
+        struct request* req = batch[b];
+        ok[b] = 1;
+        //Check for any account with insufficient balance to see if we need to void the whole request
+        for (int trans = 0; trans < req->trans_cnt; trans++) {
+            struct batch_acct* a = find_batch_acct(accts, n, req->trans_list[trans].acc_id);
+            if (!a->loaded) {
+                a->balance = load_balance(a->acc_id, &a->seen);
+                a->loaded = 1;
+            }
+            if (req->trans_list[trans].amount < 0 && a->balance + req->trans_list[trans].amount < 0) {
+                //With early release the result waits until the balances it saw are durable
+                if (!early_release) {
+                    log_result(req, RESULT_ISF, a->acc_id);
+                }
+                isf[b] = a->acc_id;
+                ok[b] = 0;
+                break;
+            }
+        }
+        if (!ok[b]) {
+            continue;
+        }
+        //The request would be successful so apply it to the balances seen by the rest of the batch
+        for (int trans = 0; trans < req->trans_cnt; trans++) {
+            struct batch_acct* a = find_batch_acct(accts, n, req->trans_list[trans].acc_id);
+            a->balance += req->trans_list[trans].amount;
+            a->dirty = 1;
+        }
+    }
+
+    if (early_release) {
+        finish_early_release(batch, cnt, ok, isf, accts, n, steps, step_cnt);
+        free(steps);
+        free(accts);
+        for (int b = 0; b < cnt; b++) {
+            free_request(batch[b]);
+        }
+        return 1;
+    }
+
+    //Write the final balance of every changed account once, in order
+    for (int i = 0; i < n; i++) {
+        if (accts[i].dirty) {
+            storage_write(accts[i].acc_id, accts[i].balance);
+        }
+    }
+    //Then publish them together so an AUDIT or SUM sees all or none of the batch
+    publish_batch(batch[0]->request_id, accts, n);
+    for (int b = 0; b < cnt; b++) {
+        if (ok[b]) {
+            log_result(batch[b], RESULT_OK, 0);
+        }
+    }
+
+    //Release all accounts
+    unlock_steps(steps, step_cnt, accts);
+    free(steps);
+    free(accts);
+    for (int b = 0; b < cnt; b++) {
+        free_request(batch[b]);
+    }
+    return 1;
+}
+
+//--------------Worker thread code--------------
+//Run a batch popped by lanes_pop_batch, the requests are freed afterwards
+void execute_batch(struct request** batch, int cnt) {
+    //Decide what type it is
+    if (batch[0]->query != QUERY_NONE) {
+        run_query(batch[0]);
+    } else if (batch[0]->balchk_id >= 0) {
+        run_check_batch(batch, cnt);
+    } else {
+        if (optimistic_isf) {
+            cnt = reject_early_isf(batch, cnt);
+        }
+        if (cnt > 0) {
+            run_trans_batch(batch, cnt);
+        }
+    }
+}
+
+#ifdef BANK_LOCK_COARSE
+//Batched bank_mutex holds, must be called while holding queue_mutex. After the first batch
+//was popped, keep popping so one hold runs up to drain_max requests. The target follows the
+//queue depth: every worker takes its share of what is queued, so a short queue keeps
+//latency low and a deep one amortizes the lock handoff and the fflush over many requests.
+int lanes_pop_drain(struct request** batch, int cnt) {
+    int depth = lanes[LANE_FAST].num_jobs + lanes[LANE_BULK].num_jobs;
+    int live = pool.live > 0 ? pool.live : 1;
+    int want = MIN(drain_max, cnt + (depth + live - 1) / live);
+
+    while (cnt < want) {
+        struct request* req = lanes_pop();
+        if (req == NULL) {
+            break;
+        }
+        if (req->exit) {
+            //END is the last request, put it back for the next worker to handle
+            queue_add(&lanes[LANE_BULK], req);
+            break;
+        }
+        batch[cnt++] = req;
+        sem_trywait(jobs_avail);
+    }
+    return cnt;
+}
+
+//Run the requests drained for one bank_mutex hold in the order they were popped. Each run
+//of TRANS requests is one run_trans_batch, so accounts they share are read and written once,
+//and each run of CHECKs on one account shares a single read.
+void execute_drained(struct request** batch, int cnt) {
+    int i = 0;
+    while (i < cnt) {
+        int j = i + 1;
+        if (batch[i]->query == QUERY_NONE) {
+            //TRANS requests all have a balchk_id of -1
+            while (j < cnt && batch[j]->query == QUERY_NONE && batch[j]->balchk_id == batch[i]->balchk_id) {
+                j++;
+            }
+        }
+        execute_batch(batch + i, j - i);
+        i = j;
+    }
+}
+
+//Flat combining: publish the batch, then either become the combiner by taking bank_mutex
+//and run every published batch in one hold, or wait for the current combiner to run ours.
+//The list is a lock-free stack instead of one slot per worker since the pool may grow.
+void combine_batch(struct request** batch, int cnt) {
+    struct publication pub;
+    pub.batch = batch;
+    pub.cnt = cnt;
+    pub.done = 0;
+    pub.next = __atomic_load_n(&combine_list, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&combine_list, &pub.next, &pub, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    while (!__atomic_load_n(&pub.done, __ATOMIC_ACQUIRE)) {
+        if (sem_trywait(bank_mutex) != 0) {
+            sched_yield();
+            continue;
+        }
+        //Keep draining while new batches are being published, up to a limit so one
+        //thread does not stay combiner forever
+        long ran = 0;
+        for (int pass = 0; pass < COMBINE_PASSES; pass++) {
+            struct publication* list = __atomic_exchange_n(&combine_list, NULL, __ATOMIC_ACQUIRE);
+            if (list == NULL) {
+                break;
+            }
+            //Reverse the stack so batches run in the order they were published
+            struct publication* fifo = NULL;
+            while (list != NULL) {
+                struct publication* next = list->next;
+                list->next = fifo;
+                fifo = list;
+                list = next;
+            }
+            while (fifo != NULL) {
+                //The publisher may return as soon as done is set, read next first
+                struct publication* next = fifo->next;
+                execute_drained(fifo->batch, fifo->cnt);
+                __atomic_store_n(&fifo->done, 1, __ATOMIC_RELEASE);
+                fifo = next;
+                ran++;
+            }
+        }
+        stats.combine_holds++;
+        stats.combined_batches += ran;
+        fflush(output);
+        sem_post(bank_mutex);
+    }
+}
+#endif
+
+void* process_request(void* arg) {
+    struct request* req;
+    //Room for a coalesced batch or the requests drained for one bank_mutex hold
+    struct request* batch[MAX_COALESCE > MAX_DRAIN ? MAX_COALESCE : MAX_DRAIN];
+    int cnt;
+
+    affinity_pin_worker((int)(long)arg);
+
+    while(1) {
+        //Wait until a request is available, then take the lock on the lanes to grab it
+        if (!wait_for_job()) {
+            if (pool_retire()) {
                 return 0;
             }
-            req = queue_pop();
+            continue;
+        }
+        sem_wait(queue_mutex);
+        req = lanes_pop();
+        if (req != NULL) {
+            cnt = lanes_pop_batch(req, batch);
+#ifdef BANK_LOCK_COARSE
+            if (drain_max > 1 && !req->exit) {
+                cnt = lanes_pop_drain(batch, cnt);
+            }
+#endif
+            BANK_PROBE2(dequeue, req->request_id, cnt);
         }
         sem_post(queue_mutex);
-//        printf("THREAD: Got request\n");
+        if (req == NULL) {
+            //Woken up by the END command with nothing left to do
+            if (quit_cmd_received) {
+                pool_exit();
+                return 0;
+            }
+            continue;
+        }
+        pool_grow(req);
 
         //END command
         if (req->exit == 1) {
+            //Wake every worker so the idle ones see the quit flag
+            sem_wait(pool_mutex);
             quit_cmd_received = 1;
-            free(req);
+            for (int i = 0; i < pool.live; i++) {
+                sem_post(jobs_avail);
+            }
+            sem_post(pool_mutex);
+            free_request(req);
             continue;
         }
 
-        //Decide what type it is
-        if (req->balchk_id >= 0) {
-            //Then grab the mutex for the account we want to check
-            sem_wait(&acc_mutex[req->balchk_id - 1]);
-            //Do the check
-            int balance = read_account(req->balchk_id);
-//            printf("THREAD: ID %0d BAL %0d\n", req->balchk_id, balance);
-            sem_post(&acc_mutex[req->balchk_id - 1]);
-
-            //Print the check to the file
-            gettimeofday(&end, NULL);
-            fprintf(output, "%0d BAL %0d TIME %ld.%06ld %ld.%06ld\n", req->request_id, balance, req->start.tv_sec, req->start.tv_usec, end.tv_sec, end.tv_usec);
+#ifdef BANK_SIM
+        int64_t arrival = 0;
+        for (int b = 0; b < cnt; b++) {
+            arrival = batch[b]->sim_arrival > arrival ? batch[b]->sim_arrival : arrival;
+        }
+        sim_begin(arrival, cnt);
+#endif
+#ifdef BANK_LOCK_COARSE
+        if (combine) {
+            combine_batch(batch, cnt);
         } else {
-//            printf("THREAD: Performing TRANS\n");
-            //First step is to acquire a lock on all accounts involved in the request
-            for(int trans = 0; trans < req->trans_cnt; trans++) {
-//                printf("REQ %0d - Waiting on mutex for acct %0d\n", req->request_id, req->trans_list[trans].acc_id);
-                sem_wait(&acc_mutex[req->trans_list[trans].acc_id - 1]);
+            sem_wait(bank_mutex);
+            execute_drained(batch, cnt);
+            fflush(output);
+            sem_post(bank_mutex);
+        }
+        if (drain_max > 1) {
+            __atomic_fetch_add(&stats.drain_holds, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats.drained_requests, cnt, __ATOMIC_RELAXED);
+        }
+#else
+        execute_batch(batch, cnt);
+        fflush(output);
+#endif
+#ifdef BANK_SIM
+        sim_end();
+#endif
+    }
+}
+
+#ifndef BANK_SIM
+//--------------Async worker code--------------
+//A request running on the async engine, the task must stay the first member
+struct async_req {
+    struct async_task task;
+    struct async_loop* loop;
+    struct request* req;
+    //Accounts of the request sorted by ID, locked in that order
+    struct batch_acct* accts;
+    int n;
+    //How many accounts are locked so far
+    int locked;
+    //Next account to read or write
+    int next;
+};
+
+//Unlock the accounts a task holds, in reverse order
+void async_unlock(struct async_req* ar) {
+    while (ar->locked > 0) {
+        ar->locked--;
+        struct batch_acct* a = &ar->accts[ar->locked];
+        acct_lock_release(&accounts[a->acc_id - 1].lock, &a->node);
+    }
+}
+
+//Write the next dirty account, or publish the request and finish it once all are written
+int async_write_next(struct async_req* ar) {
+    while (ar->next < ar->n) {
+        struct batch_acct* a = &ar->accts[ar->next++];
+        if (a->dirty) {
+            return async_write(ar->loop, &ar->task, a->acc_id, a->balance);
+        }
+    }
+    publish_batch(ar->req->request_id, ar->accts, ar->n);
+    log_result(ar->req, RESULT_OK, 0);
+    async_unlock(ar);
+    return ASYNC_DONE;
+}
+
+//State machine of a CHECK or TRANS: take the account locks, read every account, then
+//either answer or apply the request and write the changed accounts back. Locks are tried
+//in ascending order and a task that finds one taken sleeps and tries again, so waiting
+//for a lock never blocks the other tasks of the thread.
+int async_step(struct async_task* t) {
+    struct async_req* ar = (struct async_req*)t;
+    struct request* req = ar->req;
+
+    switch (t->state) {
+    case ASYNC_STATE_LOCK:
+        while (ar->locked < ar->n) {
+            struct batch_acct* a = &ar->accts[ar->locked];
+            if (!acct_lock_try(&accounts[a->acc_id - 1].lock, &a->node)) {
+                __atomic_fetch_add(&stats.async_lock_waits, 1, __ATOMIC_RELAXED);
+                return async_sleep(ar->loop, t, ASYNC_LOCK_POLL_NSEC);
             }
-//            printf("THREAD: Accounts locked\n");
-
-            //Start by checking for any accounts with insufficient balance to see if we need to void the whole request
-            for (int trans = 0; trans < req->trans_cnt; trans++) {
-                int acct_balance = read_account(req->trans_list[trans].acc_id);
-                if (req->trans_list[trans].amount < 0) {
-                    //Insufficient
-                    if (acct_balance + req->trans_list[trans].amount < 0) {
-                        gettimeofday(&end, NULL);
-                        fprintf(output, "%0d ISF %0d TIME %ld.%06ld %ld.%06ld\n", req->request_id, req->trans_list[trans].acc_id, req->start.tv_sec, req->start.tv_usec, end.tv_sec, end.tv_usec);
-                        fflush(output);
-                        insufficient = 1;
-                        break;
-                    }
-                }
-                //The transaction would be successful so
-                //add the account balance to the transaction amount so for the proceeding account write
-                req->trans_list[trans].amount += acct_balance;
+            ar->locked++;
+        }
+        BANK_PROBE2(lock_acquired, req->request_id, ar->n);
+        if (ar->n == 0) {
+            log_result(req, RESULT_OK, 0);
+            return ASYNC_DONE;
+        }
+        t->state = ASYNC_STATE_READ;
+        ar->next = 0;
+        return async_read(ar->loop, t, ar->accts[0].acc_id);
+
+    case ASYNC_STATE_READ:
+        ar->accts[ar->next].balance = t->value;
+        ar->accts[ar->next].loaded = 1;
+        if (++ar->next < ar->n) {
+            return async_read(ar->loop, t, ar->accts[ar->next].acc_id);
+        }
+        if (req->balchk_id >= 0) {
+            log_result(req, RESULT_BAL, ar->accts[0].balance);
+            async_unlock(ar);
+            return ASYNC_DONE;
+        }
+        //Same checks as a batch of one in run_trans_batch
+        for (int trans = 0; trans < req->trans_cnt; trans++) {
+            struct batch_acct* a = find_batch_acct(ar->accts, ar->n, req->trans_list[trans].acc_id);
+            if (req->trans_list[trans].amount < 0 && a->balance + req->trans_list[trans].amount < 0) {
+                log_result(req, RESULT_ISF, a->acc_id);
+                async_unlock(ar);
+                return ASYNC_DONE;
             }
-            if (insufficient) {
-                //Release all accounts
-                for(int trans = 0; trans < req->trans_cnt; trans++) {
-                    sem_post(&acc_mutex[req->trans_list[trans].acc_id - 1]);
-//                    printf("REQ %0d - Released mutex for acct %0d\n", req->request_id, req->trans_list[trans].acc_id);
+        }
+        for (int trans = 0; trans < req->trans_cnt; trans++) {
+            struct batch_acct* a = find_batch_acct(ar->accts, ar->n, req->trans_list[trans].acc_id);
+            a->balance += req->trans_list[trans].amount;
+            a->dirty = 1;
+        }
+        t->state = ASYNC_STATE_WRITE;
+        ar->next = 0;
+        return async_write_next(ar);
+
+    default:
+        return async_write_next(ar);
+    }
+}
+
+void async_finish(struct async_task* t) {
+    struct async_req* ar = (struct async_req*)t;
+    free_request(ar->req);
+    free(ar->accts);
+    free(ar);
+}
+
+//Turn a CHECK or TRANS into a task on the loop of this worker
+void async_submit(struct async_loop* loop, struct request* req) {
+    struct async_req* ar = malloc(sizeof(struct async_req));
+    int cnt = req->balchk_id >= 0 ? 1 : req->trans_cnt;
+    int n = 0;
+
+    ar->accts = malloc((cnt > 0 ? cnt : 1) * sizeof(struct batch_acct));
+    if (req->balchk_id >= 0) {
+        ar->accts[n++].acc_id = req->balchk_id;
+    } else {
+        for (int i = 0; i < req->trans_cnt; i++) {
+            ar->accts[n++].acc_id = req->trans_list[i].acc_id;
+        }
+    }
+    //Sort and drop duplicates like run_trans_batch
+    qsort(ar->accts, n, sizeof(struct batch_acct), compare_batch_acct);
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || ar->accts[unique - 1].acc_id != ar->accts[i].acc_id) {
+            ar->accts[unique] = ar->accts[i];
+            ar->accts[unique].loaded = 0;
+            ar->accts[unique++].dirty = 0;
+        }
+    }
+    ar->n = unique;
+    ar->locked = 0;
+    ar->next = 0;
+    ar->loop = loop;
+    ar->req = req;
+    ar->task.step = async_step;
+    ar->task.state = ASYNC_STATE_LOCK;
+    async_start(loop, &ar->task);
+}
+
+//Requests in flight on the loop, a request submitted now runs after them
+int async_pending(struct async_loop* loop, struct request** reqs) {
+    int cnt = 0;
+    for (struct async_task* t = loop->tasks; t != NULL; t = t->next_task) {
+        reqs[cnt++] = ((struct async_req*)t)->req;
+    }
+    return cnt;
+}
+
+//Worker of the async engine. Keeps up to async_inflight CHECK and TRANS requests in
+//flight on its own event loop and only blocks when it has nothing to run.
+void* async_worker(void* arg) {
+    struct async_loop loop;
+    struct request* req;
+    //In flight requests checked by the optimistic ISF check
+    struct request* ahead[async_inflight];
+    int isf_acc;
+
+    affinity_pin_worker((int)(long)arg);
+    async_loop_init(&loop);
+
+    while (1) {
+        async_run(&loop, async_finish);
+        fflush(output);
+
+        int64_t due = async_next_due(&loop);
+        if (loop.inflight >= async_inflight) {
+            //Full, wait for a storage access or the earliest sleeper instead of taking more work
+            async_wait(&loop, due);
+            continue;
+        }
+        //After END a worker drains the lanes without waiting on jobs_avail, the wake ups
+        //END posted belong to the workers still blocked in wait_for_job
+        int woken = 0;
+        if (loop.inflight == 0 && !quit_cmd_received) {
+            if (!wait_for_job()) {
+                if (pool_retire()) {
+                    break;
                 }
-                free(req);
-                fflush(output);
                 continue;
             }
+            woken = 1;
+        } else if (loop.inflight > 0) {
+            //Completed storage accesses do not post jobs_avail, look for new requests at
+            //least every ASYNC_JOB_POLL_NSEC while tasks are in flight
+            int64_t poll = async_now() + ASYNC_JOB_POLL_NSEC;
+            async_wait(&loop, due >= 0 && due < poll ? due : poll);
+            if (!quit_cmd_received) {
+                if (sem_trywait(jobs_avail) != 0) {
+                    continue;
+                }
+                woken = 1;
+            }
+        }
 
-            //Proceed to perform each transaction, in order
-            for (int trans = 0; trans < req->trans_cnt; trans++) {
-                write_account(req->trans_list[trans].acc_id, req->trans_list[trans].amount);
+        sem_wait(queue_mutex);
+        req = lanes_pop();
+        sem_post(queue_mutex);
+        if (req == NULL) {
+            if (quit_cmd_received && woken && loop.inflight > 0) {
+                //Took a wake up END meant for an idle worker, hand it back
+                sem_post(jobs_avail);
+            }
+            if (quit_cmd_received && loop.inflight == 0) {
+                pool_exit();
+                break;
             }
-            //End of transaction action
-            gettimeofday(&end, NULL);
-            fprintf(output, "%0d OK TIME %ld.%06ld %ld.%06ld\n", req->request_id, req->start.tv_sec, req->start.tv_usec, end.tv_sec, end.tv_usec);
+            continue;
         }
+        BANK_PROBE2(dequeue, req->request_id, 1);
+        pool_grow(req);
 
-        //Release all accounts
-        for(int trans = 0; trans < req->trans_cnt; trans++) {
-            sem_post(&acc_mutex[req->trans_list[trans].acc_id - 1]);
-//            printf("REQ %0d - Released mutex for acct %0d\n", req->request_id, req->trans_list[trans].acc_id);
+        if (req->exit == 1) {
+            sem_wait(pool_mutex);
+            quit_cmd_received = 1;
+            for (int i = 0; i < pool.live; i++) {
+                sem_post(jobs_avail);
+            }
+            sem_post(pool_mutex);
+            free_request(req);
+        } else if (req->query != QUERY_NONE) {
+            //Queries never touch storage, they run to completion right away
+            run_query(req);
+        } else if (req->balchk_id < 0 && optimistic_isf &&
+                   (isf_acc = find_early_isf(req, ahead, async_pending(&loop, ahead))) != 0) {
+            reject_early(req, isf_acc);
+        } else {
+            async_submit(&loop, req);
         }
+    }
+    async_loop_free(&loop);
+    return 0;
+}
+#endif
 
-        free(req);
-        fflush(output);
+//Read the next space separated token of the current input line into buf, longer tokens
+//are cut to fit. Returns 0 once the line (or the input) has no more tokens.
+int next_token(FILE* in, char* buf, int max) {
+    int c;
+    int len = 0;
+
+    do {
+        c = getc_unlocked(in);
+    } while (c == ' ' || c == '\t' || c == '\r');
+    if (c == '\n') {
+        //Leave the newline for skip_line() so the end of the line is seen once per caller
+        ungetc(c, in);
+        return 0;
     }
+    if (c == EOF) {
+        return 0;
+    }
+    while (c != EOF && c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+        if (len < max - 1) {
+            buf[len++] = (char)c;
+        }
+        c = getc_unlocked(in);
+    }
+    if (c == '\n') {
+        ungetc(c, in);
+    }
+    buf[len] = '\0';
+    return 1;
 }
 
-void create_trans(char command[]) {
-    char command_copy[MAX_REQ_LEN];
+//Throw away the rest of the current input line. Returns 0 if the input has ended.
+int skip_line(FILE* in) {
+    int c;
+    do {
+        c = getc_unlocked(in);
+    } while (c != '\n' && c != EOF);
+    return c != EOF;
+}
+
+//Parse one request line straight from the input and queue it. The line is read token
+//by token, so a TRANS can list any number of pairs. Returns 0 once END has been queued,
+//which also happens when the input ends without an END command.
+int create_trans(FILE* in) {
+    char token[MAX_TOKEN_LEN];
     static int req_id = 1;
     struct request* req;
+    int lane = LANE_BULK;
+    int more = 1;
 
-    //Create a copy of the command for later usage
-    strcpy(command_copy, command);
     //Create the request trans
     req = malloc(sizeof(struct request));
     req->request_id = req_id;
-    printf("ID %0d\n", req->request_id);
+    req->trans_list = NULL;
+    req->trans_cnt = 0;
+    req->retries = 0;
+    req->exit = 0;
+    req->query = QUERY_NONE;
 
     //Get the type of command we are executing
-    char* trans_type;
-    trans_type = strtok(command_copy, " ");
-    if (strcmp(trans_type, "CHECK") == 0) {
-        //All we need in a balance check trans is the account number
-        req->balchk_id = atoi(strtok(NULL, " "));
-        req->exit = 0;
-    }
-    else if (strcmp(trans_type, "TRANS") == 0) {
-        req->trans_cnt = 0;
-        //Start by grabbing the number of <account, amount> pairs from a copy of the command
-        while (1) {
-            if (strtok(NULL, " ") != NULL) {
-                if (strtok(NULL, " ") != NULL) {
-                    //Pair
-                    req->trans_cnt++;
-                }
-                else {
-                    //There's no amount associated with the account so this request is invalid
-                    free(req);
-                    return;
-                }
-            }
-            else {
-                //We're out of pairs to grab
-                break;
-            }
+    if (!next_token(in, token, MAX_TOKEN_LEN)) {
+        if (skip_line(in)) {
+            //Blank line
+            free(req);
+            return 1;
         }
-        //Allocate an array of transactions
-        struct transaction* trans_array;
-        trans_array = (struct transaction*)malloc(req->trans_cnt * sizeof(struct transaction));
+        //The input ended without END, treat it as one so the workers still finish
+        strcpy(token, "END");
+    }
+    if (strcmp(token, "CHECK") == 0) {
+        //All we need in a balance check trans is the account number
+        req->balchk_id = next_token(in, token, MAX_TOKEN_LEN) ? atoi(token) : 0;
+        lane = LANE_FAST;
+    }
+    else if (strcmp(token, "TRANS") == 0) {
+        int capacity = 8;
+        req->trans_list = (struct transaction*)malloc(capacity * sizeof(struct transaction));
         //Also set balchk_id to -1 to denote that this is a trans request
         req->balchk_id = -1;
-        int curr_trans = 0;
-
-        //Throw away the first token in the original command since we already know it
-        strtok(command, " ");
-        while (curr_trans < req->trans_cnt) {
-            struct transaction* t;
-            t = malloc(sizeof(struct transaction));
-
-            //"Command" is already stored in buffer for strtok so keep going through it
-            int acc_id = atoi(strtok(NULL, " "));
-            int amount = atoi(strtok(NULL, " "));
-            t->acc_id = acc_id;
-            t->amount = amount;
 
-            trans_array[curr_trans] = *t;
-            curr_trans++;
+        //Grab <account, amount> pairs until the end of the line, growing the array as needed
+        while (next_token(in, token, MAX_TOKEN_LEN)) {
+            int acc_id = atoi(token);
+            if (!next_token(in, token, MAX_TOKEN_LEN)) {
+                //There's no amount associated with the account so this request is invalid
+                printf("ERROR: TRANS account %d has no amount\n", acc_id);
+                free_request(req);
+                return skip_line(in);
+            }
+            if (req->trans_cnt == capacity) {
+                capacity *= 2;
+                req->trans_list = (struct transaction*)realloc(req->trans_list, capacity * sizeof(struct transaction));
+            }
+            req->trans_list[req->trans_cnt].acc_id = acc_id;
+            req->trans_list[req->trans_cnt].amount = atoi(token);
+            req->trans_cnt++;
         }
 
-        //TODO: Sort the transaction list in ascending order of account ID before we add it
-        //This will fix the deadlock issue
-        sort_transactions(trans_array, req->trans_cnt);
-        req->trans_list = trans_array;
-
-        req->exit = 0;
-//        for(int i = 0; i < req->trans_cnt; i++) {
-//            printf("DEBUG: TRANS[%0d] -> %0d %0d\n", i, req->trans_list[i].acc_id, req->trans_list[i].amount);
-//        }
+        //Sort the transaction list in ascending order of account ID so locks are always taken in order
+        sort_transactions(req->trans_list, req->trans_cnt);
+    }
+    else if (strcmp(token, "AUDIT") == 0) {
+        //Sum of all balances, runs in FIFO order with the TRANS requests
+        req->balchk_id = -1;
+        req->query = QUERY_AUDIT;
+    }
+    else if (strcmp(token, "SUM") == 0) {
+        //Total over an account range, also in FIFO order with the TRANS requests
+        req->balchk_id = -1;
+        req->query = QUERY_SUM;
+        req->range_lo = next_token(in, token, MAX_TOKEN_LEN) ? atoi(token) : 0;
+        req->range_hi = next_token(in, token, MAX_TOKEN_LEN) ? atoi(token) : 0;
+        if (req->range_lo < 1 || req->range_hi > num_accounts || req->range_lo > req->range_hi) {
+            printf("ERROR: SUM range must be within 1 and %d\n", num_accounts);
+            free(req);
+            return skip_line(in);
+        }
+    }
+    else if (strcmp(token, "TOP") == 0 || strcmp(token, "BOTTOM") == 0) {
+        //Accounts with the largest or smallest balances
+        req->balchk_id = -1;
+        req->query = token[0] == 'T' ? QUERY_TOP : QUERY_BOTTOM;
+        req->top_k = next_token(in, token, MAX_TOKEN_LEN) ? atoi(token) : 0;
+        if (req->top_k < 1) {
+            printf("ERROR: TOP and BOTTOM need a count of at least 1\n");
+            free(req);
+            return skip_line(in);
+        }
+        req->top_k = MIN(req->top_k, num_accounts);
     }
-    else if (strcmp(trans_type, "END\n") == 0) {
+    else if (strcmp(token, "END") == 0) {
         req->balchk_id = -1;
         req->exit = 1;
+        more = 0;
     }
     else {
         //This was not a valid transaction type
         printf("ERROR: Invalid request type\n");
-        return;
+        free(req);
+        return skip_line(in);
+    }
+    if (!skip_line(in)) {
+        more = 0;
     }
+    printf("ID %0d\n", req->request_id);
 
     //Get the start time
-    struct timeval* start = malloc(sizeof(struct timeval));
-    gettimeofday(start, NULL);
-    req->start = *start;
+    gettimeofday(&req->start, NULL);
+#ifdef BANK_SIM
+    req->sim_arrival = sim_next_arrival();
+#endif
+    if (trace_path != NULL) {
+        //struct transaction is an account/amount pair of ints, the layout of a TRACE_TRANS record
+        if (req->exit) {
+            trace_append(&trace, &req->start, TRACE_END, NULL, 0);
+        } else if (req->query == QUERY_AUDIT) {
+            trace_append(&trace, &req->start, TRACE_AUDIT, NULL, 0);
+        } else if (req->query == QUERY_SUM) {
+            int32_t range[2] = {req->range_lo, req->range_hi};
+            trace_append(&trace, &req->start, TRACE_SUM, range, 2);
+        } else if (req->query == QUERY_TOP || req->query == QUERY_BOTTOM) {
+            int32_t k = req->top_k;
+            trace_append(&trace, &req->start, req->query == QUERY_TOP ? TRACE_TOP : TRACE_BOTTOM, &k, 1);
+        } else if (lane == LANE_FAST) {
+            trace_append(&trace, &req->start, TRACE_CHECK, (int32_t*)&req->balchk_id, 1);
+        } else {
+            trace_append(&trace, &req->start, TRACE_TRANS, (int32_t*)req->trans_list, 2 * req->trans_cnt);
+        }
+    }
 
-    queue_add(req);
+    BANK_PROBE2(enqueue, req->request_id, lane);
+    sem_wait(queue_mutex);
+    queue_add(&lanes[lane], req);
+    sem_post(queue_mutex);
+    sem_post(jobs_avail);
 
     req_id++;
+    if (!more && !req->exit) {
+        //The input ended right after this request, follow it with an END
+        return create_trans(in);
+    }
+    return more;
+}
+
+//Returns the value part of "--name=value" if arg is that option, NULL otherwise
+char* option_value(char* arg, char* name) {
+    int len = strlen(name);
+    if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+        return arg + len + 1;
+    }
+    return NULL;
+}
+
+//Parse one of the optional tuning flags given after the positional arguments
+int parse_option(char* arg) {
+    char* val;
+    if ((val = option_value(arg, "--fast-weight")) != NULL) {
+        fast_lane_weight = atoi(val);
+    } else if ((val = option_value(arg, "--aging-ms")) != NULL) {
+        aging_usec = atol(val) * 1000;
+    } else if ((val = option_value(arg, "--min-threads")) != NULL) {
+        min_threads = atoi(val);
+    } else if ((val = option_value(arg, "--max-threads")) != NULL) {
+        max_threads = atoi(val);
+    } else if ((val = option_value(arg, "--target-wait-ms")) != NULL) {
+        target_wait_usec = atol(val) * 1000;
+    } else if ((val = option_value(arg, "--idle-timeout-ms")) != NULL) {
+        idle_timeout_usec = atol(val) * 1000;
+    } else if ((val = option_value(arg, "--coalesce")) != NULL) {
+        coalesce_max = atoi(val);
+        if (coalesce_max < 1 || coalesce_max > MAX_COALESCE) {
+            printf("ERROR: --coalesce must be between 1 and %d\n", MAX_COALESCE);
+            return 0;
+        }
+    } else if ((val = option_value(arg, "--optimistic-isf")) != NULL) {
+        optimistic_isf = atoi(val);
+    } else if ((val = option_value(arg, "--lock-timeout-ms")) != NULL) {
+        lock_timeout_usec = atol(val) * 1000;
+    } else if ((val = option_value(arg, "--lock-retries")) != NULL) {
+        lock_retries = atoi(val);
+    } else if ((val = option_value(arg, "--range-locks")) != NULL) {
+        range_locks = atoi(val);
+    } else if ((val = option_value(arg, "--early-release")) != NULL) {
+        early_release = atoi(val);
+#ifdef BANK_LOCK_COARSE
+    } else if ((val = option_value(arg, "--combine")) != NULL) {
+        combine = atoi(val);
+    } else if ((val = option_value(arg, "--drain")) != NULL) {
+        drain_max = atoi(val);
+        if (drain_max < 1 || drain_max > MAX_DRAIN) {
+            printf("ERROR: --drain must be between 1 and %d\n", MAX_DRAIN);
+            return 0;
+        }
+#endif
+#ifdef BANK_SIM
+    } else if ((val = option_value(arg, "--sim-latency")) != NULL) {
+        if (!sim_set_latency(val)) {
+            printf("ERROR: --sim-latency must be fixed:MS, lognormal:MEDIAN_MS:SIGMA or bimodal:FAST_MS:SLOW_MS:SLOW_FRACTION\n");
+            return 0;
+        }
+    } else if ((val = option_value(arg, "--sim-rate")) != NULL) {
+        sim_set_arrival_rate(atof(val));
+#else
+    } else if ((val = option_value(arg, "--engine")) != NULL) {
+        if (strcmp(val, "async") == 0) {
+            engine = ENGINE_ASYNC;
+        } else if (strcmp(val, "threads") != 0) {
+            printf("ERROR: --engine must be threads or async\n");
+            return 0;
+        }
+    } else if ((val = option_value(arg, "--inflight")) != NULL) {
+        async_inflight = atoi(val);
+        if (async_inflight < 1) {
+            printf("ERROR: --inflight must be at least 1\n");
+            return 0;
+        }
+    } else if ((val = option_value(arg, "--io-threads")) != NULL) {
+        io_thread_count = atoi(val);
+        if (io_thread_count < 1) {
+            printf("ERROR: --io-threads must be at least 1\n");
+            return 0;
+        }
+#endif
+    } else if ((val = option_value(arg, "--log-format")) != NULL) {
+        if (strcmp(val, "binary") == 0) {
+            binary_log = 1;
+        } else if (strcmp(val, "text") != 0) {
+            printf("ERROR: --log-format must be text or binary\n");
+            return 0;
+        }
+    } else if ((val = option_value(arg, "--trace")) != NULL) {
+        trace_path = val;
+    } else if ((val = option_value(arg, "--pin")) != NULL) {
+        if (strcmp(val, "cores") == 0) {
+            pin_mode = PIN_CORES;
+        } else if (strcmp(val, "set") == 0) {
+            pin_mode = PIN_SET;
+        } else if (strcmp(val, "none") != 0) {
+            printf("ERROR: --pin must be cores, set or none\n");
+            return 0;
+        }
+    } else if ((val = option_value(arg, "--cpus")) != NULL) {
+        pin_cpus = val;
+    } else if ((val = option_value(arg, "--numa")) != NULL) {
+        if (strcmp(val, "interleave") == 0) {
+            numa_mode = NUMA_INTERLEAVE;
+        } else if (strcmp(val, "none") != 0) {
+            printf("ERROR: --numa must be interleave or none\n");
+            return 0;
+        }
+    } else {
+        printf("ERROR: Unknown option %s\n", arg);
+        return 0;
+    }
+    return 1;
 }
 
+//MicroBench.c includes this file with BANK_BENCH defined and brings its own main
+#ifndef BANK_BENCH
 int main (int argc, char* argv[]) {
-    int num_threads = 0;
-    int num_accounts = 0;
     char* output_filename;
     //--------------Do the initial setup--------------
     if (argc < 4) {
-        printf("Invalid commandline config attempted: appserver [thread_count] [account_count] [output_filename]\n");
+        printf("Invalid commandline config attempted: appserver [thread_count] [account_count] [output_filename] [options]\n");
+        printf("Options:\n");
+        printf("  --fast-weight=N  CHECK requests served per TRANS request when both lanes are busy (default %d)\n", DEFAULT_FAST_WEIGHT);
+        printf("  --aging-ms=N     Serve any request waiting longer than N ms first (default %d)\n", DEFAULT_AGING_USEC / 1000);
+        printf("  --min-threads=N  Never shrink the worker pool below N threads (default thread_count)\n");
+        printf("  --max-threads=N  Grow the worker pool up to N threads (default thread_count)\n");
+        printf("  --target-wait-ms=N  Add a worker when a request waited longer than N ms in the queue (default %d)\n", DEFAULT_TARGET_WAIT_USEC / 1000);
+        printf("  --idle-timeout-ms=N Retire a worker above the minimum after N ms without work (default %d)\n", DEFAULT_IDLE_TIMEOUT_USEC / 1000);
+        printf("  --coalesce=N     Run up to N queued requests on the same accounts as one batch, 1 disables (default %d)\n", DEFAULT_COALESCE);
+        printf("  --optimistic-isf=0|1  Reject TRANS requests that clearly cause ISF before locking (default 1)\n");
+        printf("  --lock-timeout-ms=N  Requeue a TRANS that waited N ms for its locks, 0 waits forever (default 0)\n");
+        printf("  --lock-retries=N Report TIMEOUT after a TRANS was requeued N times (default %d)\n", DEFAULT_LOCK_RETRIES);
+        printf("  --range-locks=0|1  Lock whole blocks of %d accounts at once for TRANS covering them (default 0)\n", LOCK_BLOCK_SIZE);
+        printf("  --early-release=0|1  Release TRANS account locks once balances are installed in memory, report\n");
+        printf("                   results after the storage writes they depend on (default 0)\n");
+#ifdef BANK_LOCK_COARSE
+        printf("  --combine=0|1    Run request batches through flat combining on bank_mutex (default 0)\n");
+        printf("  --drain=N        Run up to N queued requests per bank_mutex hold, adapting to queue depth (default 1)\n");
+#endif
+#ifdef BANK_SIM
+        printf("  --sim-latency=DIST  Simulated storage latency: fixed:MS, lognormal:MEDIAN_MS:SIGMA or\n");
+        printf("                   bimodal:FAST_MS:SLOW_MS:SLOW_FRACTION (default fixed:10)\n");
+        printf("  --sim-rate=N     Requests arrive N per virtual second, 0 queues them all at time 0 (default 0)\n");
+#else
+        printf("  --engine=threads|async  Run one request batch per worker at a time, or interleave many\n");
+        printf("                   requests per worker that suspend on storage and lock waits (default threads)\n");
+        printf("  --inflight=N     Most requests each async worker keeps in flight (default %d)\n", DEFAULT_INFLIGHT);
+        printf("  --io-threads=N   Threads making the blocking storage calls for the async workers (default %d)\n", DEFAULT_IO_THREADS);
+#endif
+        printf("  --log-format=text|binary  Write result lines, or 32 byte records for ./result-decode (default text)\n");
+        printf("  --trace=FILE     Record every request with its arrival time to FILE for ./replay\n");
+        printf("  --pin=cores|set  Pin each worker to one CPU, or all workers to the CPU set (default none)\n");
+        printf("  --cpus=LIST      CPUs used by --pin, e.g. 0-3,8 (default every allowed CPU)\n");
+        printf("  --numa=interleave  Spread the account and lock arrays over NUMA nodes page by page (default none)\n");
         return 255;
     } else {
         num_threads = atoi(argv[1]);
         num_accounts = atoi(argv[2]);
         output_filename = argv[3];
     }
+    for (int i = 4; i < argc; i++) {
+        if (!parse_option(argv[i])) {
+            return 255;
+        }
+    }
+    //The pool starts at thread_count and stays fixed unless a min or max was given
+    if (min_threads <= 0 || min_threads > num_threads) {
+        min_threads = num_threads < 1 ? 1 : num_threads;
+    }
+    if (max_threads < num_threads) {
+        max_threads = num_threads;
+    }
+    if (max_threads < min_threads) {
+        max_threads = min_threads;
+    }
+#ifdef BANK_SIM
+    //Model the largest pool the server may grow to
+    sim_set_workers(max_threads);
+#endif
+    if (engine == ENGINE_ASYNC && (range_locks || lock_timeout_usec > 0)) {
+        printf("ERROR: --engine=async does not support --range-locks or --lock-timeout-ms\n");
+        return 255;
+    }
+    if (engine == ENGINE_ASYNC && early_release) {
+        printf("ERROR: --engine=async does not support --early-release\n");
+        return 255;
+    }
+#ifdef BANK_LOCK_COARSE
+    //Every request already runs under bank_mutex, there are no account locks to wait for
+    if (engine == ENGINE_ASYNC || range_locks || lock_timeout_usec > 0 || early_release) {
+        printf("ERROR: appserver-coarse does not support --engine=async, --range-locks, --lock-timeout-ms or --early-release\n");
+        return 255;
+    }
+#endif
+    if (!affinity_configure(pin_mode, pin_cpus)) {
+        printf("ERROR: Invalid CPU list %s\n", pin_cpus);
+        return 255;
+    }
 
     //--------------Open our output file for editing--------------
     output = fopen(output_filename, "w");
@@ -311,55 +2021,142 @@ int main (int argc, char* argv[]) {
         printf("ERROR: Could not open file\n");
         return 254;
     }
+    if (binary_log) {
+        result_log_header(output);
+    }
+    if (trace_path != NULL && !trace_create(&trace, trace_path, num_accounts)) {
+        printf("ERROR: Could not open trace file %s\n", trace_path);
+        return 254;
+    }
 
     //--------------Initialize desired number of bank accounts--------------
-    printf("Initializing %d accounts...\n", num_accounts);
+#ifdef BANK_LOCK_COARSE
+    printf("Initializing %d accounts (coarse bank_mutex)...\n", num_accounts);
+#else
+    printf("Initializing %d accounts (%s account locks)...\n", num_accounts, ACCT_LOCK_NAME);
+#endif
     initialize_accounts(num_accounts);
+    affinity_place_memory(BANK_accounts, num_accounts * sizeof(int), numa_mode);
 
-    //--------------Create a queue struct to hold our requests--------------
-    q = malloc(sizeof(struct queue));
-    q->head = NULL;
-    q->tail = NULL;
-    q->num_jobs = 0;
+    //--------------Create the lanes to hold our requests--------------
+    lanes = malloc(NUM_LANES * sizeof(struct queue));
+    for (int i = 0; i < NUM_LANES; i++) {
+        lanes[i].head = NULL;
+        lanes[i].tail = NULL;
+        lanes[i].num_jobs = 0;
+    }
 
-    //--------------Initialize semaphores--------------
-    acc_mutex = (sem_t*)malloc(num_accounts * sizeof(sem_t));
+    //--------------Initialize account records and semaphores--------------
+    //Page aligned so the NUMA policy covers the whole array, placed before first touch
+    accounts = (struct account*)affinity_alloc(num_accounts * sizeof(struct account));
+    affinity_place_memory(accounts, num_accounts * sizeof(struct account), numa_mode);
     for (int i = 0; i < num_accounts; i++) {
-        sem_init(&acc_mutex[i], 0, 1);
+        acct_lock_init(&accounts[i].lock);
+        accounts[i].balance = 0;
+        accounts[i].version = 0;
+    }
+    if (range_locks) {
+        int num_blocks = (num_accounts + LOCK_BLOCK_SIZE - 1) / LOCK_BLOCK_SIZE;
+        block_locks = (pthread_rwlock_t*)malloc(num_blocks * sizeof(pthread_rwlock_t));
+        for (int i = 0; i < num_blocks; i++) {
+            pthread_rwlock_init(&block_locks[i], NULL);
+        }
     }
     queue_mutex = (sem_t*)malloc(sizeof(sem_t));
     sem_init(queue_mutex, 0, 1);
+    jobs_avail = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(jobs_avail, 0, 0);
+    pool_mutex = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(pool_mutex, 0, 1);
+    pool_done = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(pool_done, 0, 0);
+    audit_mutex = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(audit_mutex, 0, 1);
+    if (early_release) {
+        durability = (struct durable_state*)malloc(num_accounts * sizeof(struct durable_state));
+        for (int i = 0; i < num_accounts; i++) {
+            pthread_mutex_init(&durability[i].write_lock, NULL);
+            durability[i].version = 0;
+        }
+    }
+    fenwick_init(&balance_index, num_accounts);
+    ranking_init(&balance_ranking, num_accounts);
+    ranking_mutex = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(ranking_mutex, 0, 1);
+#ifdef BANK_LOCK_COARSE
+    bank_mutex = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(bank_mutex, 0, 1);
+#endif
 
     //--------------Start worker threads--------------
-    pthread_t processing_threads[num_threads];
-    printf("Creating %d worker threads...\n", num_threads);
+#ifndef BANK_SIM
+    if (engine == ENGINE_ASYNC && !async_io_start(io_thread_count)) {
+        printf("ERROR: Could not start the I/O threads\n");
+        return 254;
+    }
+#endif
+    printf("Creating %d worker threads (min %d, max %d)...\n", num_threads, min_threads, max_threads);
+    sem_wait(pool_mutex);
     for (int i = 0; i < num_threads; i++) {
-        //Pass the starting memory addresses of the semaphore array
-        pthread_create(&processing_threads[i], NULL, process_request, NULL);
+        pool_spawn();
     }
+    sem_post(pool_mutex);
     printf("Done setup.\n");
 
     //--------------Get input requests--------------
-    char command[MAX_REQ_LEN];
-    while (1) {
-        //Get input from stdin and add to queue
-        fgets(command, MAX_REQ_LEN, stdin);
-        if (strcmp(command, "END\n") == 0) {
-            create_trans(command);
-            break;
-        } else {
-            create_trans(command);
-        }
+    //Parse requests straight from stdin and add them to the queue until END
+    while (create_trans(stdin));
+    if (trace_path != NULL) {
+        trace_close(&trace);
     }
     //Stop taking input once quit has been received
     printf("Exiting: Waiting on threads to finish processing requests...\n");
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(processing_threads[i], NULL);
+    sem_wait(pool_done);
+#ifndef BANK_SIM
+    if (engine == ENGINE_ASYNC) {
+        async_io_stop();
+    }
+#endif
+    printf("Worker pool: %d started, %d retired, peak of %d workers\n", pool.started, pool.retired, pool.peak);
+    printf("ISF requests rejected before locking: %ld\n", stats.early_isf);
+    printf("Lock wait retries: %ld, timeouts: %ld\n", stats.lock_retries, stats.lock_timeouts);
+    printf("AUDIT requests: %ld, SUM requests: %ld, optimistic retries: %ld, gated: %ld\n", stats.audits, stats.sums, stats.query_retries, stats.query_gated);
+    printf("TOP/BOTTOM requests: %ld\n", stats.rankings);
+    if (engine == ENGINE_ASYNC) {
+        printf("Async lock waits: %ld\n", stats.async_lock_waits);
+    }
+    if (early_release) {
+        printf("Early release: %ld reads of pending balances, %ld superseded writes, %ld results waited on storage\n",
+               stats.pending_reads, stats.superseded_writes, stats.durable_waits);
+    }
+#ifdef BANK_LOCK_COARSE
+    if (combine) {
+        printf("Flat combining: %ld batches in %ld lock holds\n", stats.combined_batches, stats.combine_holds);
+    }
+    if (drain_max > 1) {
+        printf("Drained holds: %ld requests in %ld bank_mutex holds\n", stats.drained_requests, stats.drain_holds);
     }
+#endif
+#ifdef BANK_SIM
+    sim_report(stdout);
+#endif
 
-    free(&acc_mutex[0]);
-    free(q);
+    free(accounts);
+    free(block_locks);
+    free(durability);
+    free(lanes);
+    free(queue_mutex);
+    free(jobs_avail);
+    free(audit_mutex);
+    fenwick_free(&balance_index);
+    ranking_free(&balance_ranking);
+    free(ranking_mutex);
+#ifdef BANK_LOCK_COARSE
+    free(bank_mutex);
+#endif
+    //pool_mutex and pool_done are not freed, exiting workers may still be returning from sem_post on them
     free_accounts();
     fclose(output);
 
 }
+#endif
@@ -0,0 +1,253 @@
+#include "BankSim.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define DIST_FIXED 0
+#define DIST_LOGNORMAL 1
+#define DIST_BIMODAL 2
+
+#define NSEC_PER_MSEC 1000000.0
+
+int* BANK_accounts;
+
+//Latency distribution, times in nanoseconds
+int dist = DIST_FIXED;
+double lat_a = 10 * NSEC_PER_MSEC;
+double lat_b = 0;
+double lat_p = 0;
+
+double arrival_rate = 0;
+long arrivals = 0;
+//Requests handed to sim_begin() so far, the rest of arrivals are still queued
+long started = 0;
+
+//Virtual time each account's last storage access finished
+int64_t* acct_ready;
+
+//Virtual time each modelled worker becomes free, INT64_MAX while busy
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+int64_t* worker_free = NULL;
+//Current virtual time of each busy worker, INT64_MAX while idle
+int64_t* worker_clock = NULL;
+int num_workers = 1;
+
+//Completed request latencies for the report
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+int64_t* latencies = NULL;
+long done_cnt = 0;
+long done_cap = 0;
+int64_t last_done = 0;
+
+__thread int64_t clock_ns = 0;
+__thread int worker_slot = -1;
+__thread uint64_t rng = 0;
+
+//xorshift64*, seeded per thread so threads do not share a generator
+double next_uniform() {
+    if (rng == 0) {
+        rng = 0x9e3779b97f4a7c15ULL ^ (uint64_t)(uintptr_t)&rng;
+    }
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return ((rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int64_t sample_latency() {
+    if (dist == DIST_LOGNORMAL) {
+        //Box-Muller, lat_a is the median and lat_b the sigma of the underlying normal
+        double u1 = next_uniform();
+        double u2 = next_uniform();
+        double z = sqrt(-2.0 * log(u1 > 0 ? u1 : 1e-300)) * cos(2 * M_PI * u2);
+        return (int64_t)(lat_a * exp(lat_b * z));
+    }
+    if (dist == DIST_BIMODAL) {
+        return (int64_t)(next_uniform() < lat_p ? lat_b : lat_a);
+    }
+    return (int64_t)lat_a;
+}
+
+//Run one storage access on the account, it starts once both the thread and the account are free
+void storage_access(int ID) {
+    int64_t ready = __atomic_load_n(&acct_ready[ID - 1], __ATOMIC_RELAXED);
+    if (ready > clock_ns) {
+        clock_ns = ready;
+    }
+    clock_ns += sample_latency();
+    __atomic_store_n(&acct_ready[ID - 1], clock_ns, __ATOMIC_RELAXED);
+    if (worker_slot >= 0) {
+        __atomic_store_n(&worker_clock[worker_slot], clock_ns, __ATOMIC_RELAXED);
+    }
+}
+
+int initialize_accounts( int n ) {
+    BANK_accounts = (int*)calloc(n, sizeof(int));
+    acct_ready = (int64_t*)calloc(n, sizeof(int64_t));
+    return BANK_accounts != NULL && acct_ready != NULL;
+}
+
+int read_account( int ID ) {
+    storage_access(ID);
+    return BANK_accounts[ID - 1];
+}
+
+void write_account( int ID, int value ) {
+    storage_access(ID);
+    BANK_accounts[ID - 1] = value;
+}
+
+void free_accounts() {
+    free(BANK_accounts);
+    free(acct_ready);
+}
+
+int sim_set_latency( char* spec ) {
+    double a, b, p;
+    if (sscanf(spec, "fixed:%lf", &a) == 1 && a >= 0) {
+        dist = DIST_FIXED;
+        lat_a = a * NSEC_PER_MSEC;
+    } else if (sscanf(spec, "lognormal:%lf:%lf", &a, &b) == 2 && a > 0 && b >= 0) {
+        dist = DIST_LOGNORMAL;
+        lat_a = a * NSEC_PER_MSEC;
+        lat_b = b;
+    } else if (sscanf(spec, "bimodal:%lf:%lf:%lf", &a, &b, &p) == 3 && a >= 0 && b >= 0 && p >= 0 && p <= 1) {
+        dist = DIST_BIMODAL;
+        lat_a = a * NSEC_PER_MSEC;
+        lat_b = b * NSEC_PER_MSEC;
+        lat_p = p;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void sim_set_arrival_rate( double rate ) {
+    arrival_rate = rate;
+}
+
+void sim_set_workers( int workers ) {
+    num_workers = workers > 0 ? workers : 1;
+    worker_free = (int64_t*)calloc(num_workers, sizeof(int64_t));
+    worker_clock = (int64_t*)malloc(num_workers * sizeof(int64_t));
+    for (int i = 0; i < num_workers; i++) {
+        worker_clock[i] = INT64_MAX;
+    }
+}
+
+//Can a request arriving at virtual time t be queued without a worker still acting before t?
+int arrival_due(int64_t t) {
+    int due = 1;
+    pthread_mutex_lock(&pool_lock);
+    long queued = arrivals - __atomic_load_n(&started, __ATOMIC_RELAXED);
+    for (int i = 0; i < num_workers && due; i++) {
+        //A busy worker may still touch accounts before t, an idle one would take a queued request before t
+        if (__atomic_load_n(&worker_clock[i], __ATOMIC_RELAXED) < t || (queued > 0 && worker_free[i] < t)) {
+            due = 0;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return due;
+}
+
+int64_t sim_next_arrival() {
+    //Only the input thread calls this
+    if (arrival_rate <= 0) {
+        arrivals++;
+        return 0;
+    }
+    if (worker_free == NULL) {
+        sim_set_workers(num_workers);
+    }
+    //Hold the request back until virtual time has caught up with it. Otherwise the lanes could
+    //run it ahead of earlier arrivals and its storage accesses would delay theirs.
+    int64_t t = (int64_t)(arrivals * 1e9 / arrival_rate);
+    while (!arrival_due(t)) {
+        sched_yield();
+    }
+    arrivals++;
+    return t;
+}
+
+void sim_begin( int64_t arrival, int cnt ) {
+    int best = 0;
+    pthread_mutex_lock(&pool_lock);
+    if (worker_free == NULL) {
+        sim_set_workers(num_workers);
+    }
+    for (int i = 1; i < num_workers; i++) {
+        if (worker_free[i] < worker_free[best]) {
+            best = i;
+        }
+    }
+    //Every modelled worker is busy only if the server runs more threads than it was told
+    if (worker_free[best] == INT64_MAX) {
+        worker_slot = -1;
+    } else {
+        clock_ns = worker_free[best];
+        worker_free[best] = INT64_MAX;
+        worker_slot = best;
+    }
+    if (arrival > clock_ns) {
+        clock_ns = arrival;
+    }
+    if (worker_slot >= 0) {
+        worker_clock[worker_slot] = clock_ns;
+    }
+    __atomic_add_fetch(&started, cnt, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+int64_t sim_complete( int64_t arrival ) {
+    pthread_mutex_lock(&done_lock);
+    if (done_cnt == done_cap) {
+        done_cap = done_cap ? done_cap * 2 : 4096;
+        latencies = (int64_t*)realloc(latencies, done_cap * sizeof(int64_t));
+    }
+    latencies[done_cnt++] = clock_ns - arrival;
+    if (clock_ns > last_done) {
+        last_done = clock_ns;
+    }
+    pthread_mutex_unlock(&done_lock);
+    return clock_ns;
+}
+
+void sim_end() {
+    if (worker_slot >= 0) {
+        pthread_mutex_lock(&pool_lock);
+        worker_free[worker_slot] = clock_ns;
+        worker_clock[worker_slot] = INT64_MAX;
+        pthread_mutex_unlock(&pool_lock);
+        worker_slot = -1;
+    }
+}
+
+int compare_int64(const void* a, const void* b) {
+    int64_t x = *(int64_t*)a;
+    int64_t y = *(int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+//Latency at quantile q of the sorted latencies, in milliseconds
+double percentile_ms(double q) {
+    long i = (long)(q * (done_cnt - 1));
+    return latencies[i] / NSEC_PER_MSEC;
+}
+
+void sim_report( FILE* out ) {
+    double sum = 0;
+    if (done_cnt == 0) {
+        fprintf(out, "Modelled: no requests completed\n");
+        return;
+    }
+    qsort(latencies, done_cnt, sizeof(int64_t), compare_int64);
+    for (long i = 0; i < done_cnt; i++) {
+        sum += latencies[i];
+    }
+    fprintf(out, "Modelled: %ld requests in %.3f virtual seconds, %.1f requests/s with %d workers\n",
+            done_cnt, last_done / 1e9, last_done > 0 ? done_cnt / (last_done / 1e9) : 0, num_workers);
+    fprintf(out, "Modelled latency (ms): mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+            sum / done_cnt / NSEC_PER_MSEC, percentile_ms(0.5), percentile_ms(0.9), percentile_ms(0.99), percentile_ms(1));
+}
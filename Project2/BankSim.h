@@ -0,0 +1,92 @@
+/*
+ *  Simulated storage for the bank server, a drop-in replacement for
+ *  Bank.c that never sleeps. Every read_account() and write_account()
+ *  advances a virtual clock by a latency drawn from the configured
+ *  distribution instead, so a run that would take hours against Bank.c
+ *  finishes in seconds and reports the throughput and latency the real
+ *  storage would have produced.
+ *
+ *  The model:
+ *  - Each request arrives at a virtual time, either all at 0 (measures
+ *    the time to drain a backlog) or spaced at a fixed rate.
+ *  - Workers are a pool of virtual free times. A worker starting a
+ *    request takes the earliest free time no sooner than the arrival,
+ *    so the model does not depend on which OS thread got the request.
+ *  - With an arrival rate, requests are only queued once every worker
+ *    has reached their arrival time, so the lanes reorder requests the
+ *    way they would at that moment and never run one early.
+ *  - Each account remembers when its last storage access finished and
+ *    a later access cannot start before that, which models waiting on
+ *    the account lock.
+ *
+ *  Request boundaries come from the server through sim_begin() and
+ *  sim_complete(), see BankServer.c built with -DBANK_SIM.
+ */
+
+#ifndef BANK_SIM_H
+#define BANK_SIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include "Bank.h"
+
+/*
+ *  Set the storage latency distribution, in milliseconds
+ *  Input:  char* spec - fixed:MS, lognormal:MEDIAN_MS:SIGMA or bimodal:FAST_MS:SLOW_MS:SLOW_FRACTION
+ *  Return:  1 if succeeded, 0 if spec could not be parsed
+ */
+int sim_set_latency( char* spec );
+
+/*
+ *  Set how requests arrive
+ *  Input:  double rate - Requests per virtual second, 0 to have every request arrive at time 0
+ */
+void sim_set_arrival_rate( double rate );
+
+/*
+ *  Set the number of modelled workers, must be called before the first sim_begin()
+ */
+void sim_set_workers( int workers );
+
+/*
+ *  Virtual arrival time of the next request, called once per request in input order.
+ *  With an arrival rate set this blocks until no worker can still act before the
+ *  arrival, so requests are only queued once they would have arrived.
+ *  Return:  Arrival time in virtual nanoseconds
+ */
+int64_t sim_next_arrival();
+
+/*
+ *  Start working on a request (or a batch of them) on the calling thread
+ *  Input:  int64_t arrival - Latest arrival time of the requests being started
+ *  Input:  int cnt - Number of requests being started
+ */
+void sim_begin( int64_t arrival, int cnt );
+
+/*
+ *  Finish one request started with sim_begin()
+ *  Input:  int64_t arrival - Arrival time of the request
+ *  Return:  Completion time of the request in virtual nanoseconds
+ */
+int64_t sim_complete( int64_t arrival );
+
+/*
+ *  Hand the calling thread's worker back to the pool after sim_begin()
+ */
+void sim_end();
+
+/*
+ *  Convert a virtual time to a timeval counted from virtual time 0
+ */
+static inline void sim_timeval( int64_t ns, struct timeval* tv ) {
+    tv->tv_sec = ns / 1000000000;
+    tv->tv_usec = (ns / 1000) % 1000000;
+}
+
+/*
+ *  Print the modelled throughput and latency percentiles
+ */
+void sim_report( FILE* out );
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ *  Fenwick tree (binary indexed tree) over the committed account
+ *  balances, answering the total of any account ID range in O(log n).
+ *
+ *  Commits add the change of each balance they install. Node updates
+ *  are atomic adds so commits on different accounts may update shared
+ *  nodes concurrently, but a range read is only consistent if no commit
+ *  is running at the same time, see the commit gate in BankServer.c.
+ */
+
+#ifndef FENWICK_H
+#define FENWICK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct fenwick {
+    //Node i covers IDs (i - lowbit(i), i], node 0 is unused
+    int64_t* node;
+    int n;
+};
+
+static inline int fenwick_init(struct fenwick* f, int n) {
+    f->n = n;
+    f->node = (int64_t*)calloc(n + 1, sizeof(int64_t));
+    return f->node != NULL;
+}
+
+/*
+ *  Add delta to the balance of account id (1 to n)
+ */
+static inline void fenwick_add(struct fenwick* f, int id, int64_t delta) {
+    for (int i = id; i <= f->n; i += i & -i) {
+        __atomic_fetch_add(&f->node[i], delta, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ *  Total of accounts 1 to id, 0 if id is 0
+ */
+static inline int64_t fenwick_prefix(struct fenwick* f, int id) {
+    int64_t sum = 0;
+    for (int i = id; i > 0; i -= i & -i) {
+        sum += __atomic_load_n(&f->node[i], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/*
+ *  Total of accounts lo to hi, both included
+ */
+static inline int64_t fenwick_range(struct fenwick* f, int lo, int hi) {
+    return fenwick_prefix(f, hi) - fenwick_prefix(f, lo - 1);
+}
+
+static inline void fenwick_free(struct fenwick* f) {
+    free(f->node);
+    f->node = NULL;
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ *  Microbenchmark comparing the account memory layouts.
+ *
+ *  split:  packed int balances next to a packed lock array, the
+ *          layout BankServer.c used before Account.h
+ *  record: one cache line aligned struct account per account
+ *
+ *  Both layouts use the account lock selected with ACCT_LOCK, so only
+ *  the placement differs between them.
+ *
+ *  Every thread repeatedly locks a random account out of a small
+ *  hot set, updates its balance and version and unlocks it, which
+ *  is the in-memory part of a commit without the storage sleep.
+ *
+ *  Usage: ./layout-bench [max_threads] [hot_accounts] [ops_per_thread]
+ *  Output is CSV on stdout, one line per layout and thread count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "Account.h"
+
+//Each configuration is timed this many times and the median is reported
+#define REPEATS 5
+
+#define LAYOUT_SPLIT 0
+#define LAYOUT_RECORD 1
+
+int hot_accounts = 16;
+long ops_per_thread = 200000;
+int layout;
+
+//Split layout
+int* split_balances;
+uint32_t* split_versions;
+acct_lock_t* split_locks;
+
+//Record layout
+struct account* records;
+
+uint32_t next_rand(uint32_t* state) {
+    //xorshift32, cheap enough not to show up next to the lock
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+void* run_thread(void* arg) {
+    uint32_t seed = (uint32_t)(long)arg * 2654435761u + 1;
+
+    struct acct_lock_node node;
+
+    for (long i = 0; i < ops_per_thread; i++) {
+        int id = next_rand(&seed) % hot_accounts;
+        if (layout == LAYOUT_SPLIT) {
+            acct_lock_acquire(&split_locks[id], &node);
+            split_balances[id]++;
+            split_versions[id]++;
+            acct_lock_release(&split_locks[id], &node);
+        } else {
+            acct_lock_acquire(&records[id].lock, &node);
+            records[id].balance++;
+            records[id].version++;
+            acct_lock_release(&records[id].lock, &node);
+        }
+    }
+    return NULL;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//Run one configuration, returns wall clock nanoseconds per operation
+double run_once(int threads) {
+    pthread_t tids[threads];
+    long total = 0;
+
+    for (int i = 0; i < hot_accounts; i++) {
+        split_balances[i] = 0;
+        split_versions[i] = 0;
+        records[i].balance = 0;
+        records[i].version = 0;
+    }
+
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, run_thread, (void*)(long)(i + 1));
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    //Make sure the locks actually protected the updates
+    for (int i = 0; i < hot_accounts; i++) {
+        total += (layout == LAYOUT_SPLIT) ? split_balances[i] : records[i].balance;
+    }
+    if (total != threads * ops_per_thread) {
+        fprintf(stderr, "ERROR: lost updates, expected %ld got %ld\n", threads * ops_per_thread, total);
+        exit(1);
+    }
+    return elapsed / (threads * ops_per_thread);
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(double*)a;
+    double y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = 8;
+    char* names[] = {"split", "record"};
+
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        hot_accounts = atoi(argv[2]);
+    if (argc > 3)
+        ops_per_thread = atol(argv[3]);
+
+    split_balances = calloc(hot_accounts, sizeof(int));
+    split_versions = calloc(hot_accounts, sizeof(uint32_t));
+    split_locks = malloc(hot_accounts * sizeof(acct_lock_t));
+    if (posix_memalign((void**)&records, CACHE_LINE, hot_accounts * sizeof(struct account)) != 0) {
+        printf("ERROR: Could not allocate records\n");
+        return 1;
+    }
+    for (int i = 0; i < hot_accounts; i++) {
+        acct_lock_init(&split_locks[i]);
+        acct_lock_init(&records[i].lock);
+    }
+
+    printf("layout,threads,hot_accounts,ops,ns_per_op\n");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        for (layout = LAYOUT_SPLIT; layout <= LAYOUT_RECORD; layout++) {
+            double samples[REPEATS];
+            for (int r = 0; r < REPEATS; r++) {
+                samples[r] = run_once(threads);
+            }
+            qsort(samples, REPEATS, sizeof(double), compare_double);
+            printf("%s,%d,%d,%ld,%.1f\n", names[layout], threads, hot_accounts, threads * ops_per_thread, samples[REPEATS / 2]);
+        }
+    }
+
+    free(split_balances);
+    free(split_versions);
+    free(split_locks);
+    free(records);
+    return 0;
+}
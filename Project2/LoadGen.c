@@ -0,0 +1,501 @@
+/*
+ *  Load generator for the bank server.
+ *
+ *  Starts the server, gives every account an initial deposit and then
+ *  drives it in one of three modes:
+ *
+ *  closed  Keep a fixed number of requests outstanding, a new request is
+ *          sent as soon as a result line comes back
+ *  open    Send requests with Poisson arrivals at a fixed rate regardless
+ *          of how fast the server answers
+ *  ramp    Run open loop steps at increasing rates until the server can
+ *          no longer keep up, to find its saturation point
+ *
+ *  Latencies come from the server's result lines. The service latency is
+ *  the server's own end - start time. For open loop runs the corrected
+ *  latency is measured from when the request was supposed to be sent, so
+ *  time spent queued behind a slow server is not hidden (coordinated
+ *  omission). Results are written as a JSON report.
+ *
+ *  Usage: ./loadgen [program_path] [num_workers] [num_accounts] [closed|open|ramp] [options]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define MODE_CLOSED 0
+#define MODE_OPEN 1
+#define MODE_RAMP 2
+
+#define STATUS_NONE 0
+#define STATUS_OK 1
+#define STATUS_ISF 2
+#define STATUS_BAL 3
+#define STATUS_OTHER 4
+
+/* the amount of money each account starts with */
+#define AMOUNT_INITIAL_DEPOSIT 10000
+/* accounts per TRANS in the initial deposits */
+#define DEPOSIT_PAIRS 10
+/* most --server-option flags passed on to the server */
+#define MAX_SERVER_OPTIONS 8
+/* a ramp stops once the server completes less than this share of the offered rate */
+#define RAMP_SATURATED 0.9
+/* how long to wait for outstanding results after a phase, in seconds */
+#define DRAIN_TIMEOUT 60
+
+/* testing parameters */
+char program_path[200];
+char output_path[200] = "loadgen_results.txt";
+char report_path[200] = "loadgen_report.json";
+int num_workers = 10;
+int num_accounts = 1000;
+int mode = MODE_CLOSED;
+int outstanding = 16;
+double rate = 100;
+long num_requests = 2000;
+double ramp_start = 50;
+double ramp_step = 50;
+int ramp_steps = 10;
+double step_secs = 5;
+int check_percent = 20;
+unsigned int seed = 5;
+char* server_options[MAX_SERVER_OPTIONS];
+int num_server_options = 0;
+
+/* per request bookkeeping, indexed by the server's request ID */
+long max_ids;
+double* intended;   /* when the request was meant to be sent */
+double* srv_start;  /* server start and end time from the result line */
+double* srv_end;
+char* status;
+
+long next_id = 1;          /* ID the server will give the next request we send */
+long completed = 0;        /* result lines seen so far */
+atomic_int reader_stop = 0;  /* set by main once the server exited */
+pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+
+FILE* server_in;
+pid_t server_pid;
+
+double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void sleep_until(double when) {
+	double wait = when - now();
+	if (wait > 0)
+		usleep((useconds_t)(wait * 1e6));
+}
+
+/* Poisson arrivals: exponentially distributed gaps with the given mean rate */
+double next_gap(double per_sec) {
+	double u = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+	return -log(u) / per_sec;
+}
+
+/* Start the server with its stdin connected to us and its stdout discarded */
+int startServer() {
+	int fds[2];
+	char workers[20], accounts[20];
+	char* args[MAX_SERVER_OPTIONS + 5];
+	if (pipe(fds) != 0)
+		return 0;
+	server_pid = fork();
+	if (server_pid < 0)
+		return 0;
+	if (server_pid == 0) {
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(fds[0], 0);
+		dup2(devnull, 1);
+		close(fds[1]);
+		sprintf(workers, "%d", num_workers);
+		sprintf(accounts, "%d", num_accounts);
+		args[0] = program_path;
+		args[1] = workers;
+		args[2] = accounts;
+		args[3] = output_path;
+		for (int i = 0; i < num_server_options; i++)
+			args[4 + i] = server_options[i];
+		args[4 + num_server_options] = NULL;
+		execv(program_path, args);
+		perror("exec");
+		_exit(127);
+	}
+	close(fds[0]);
+	server_in = fdopen(fds[1], "w");
+	return server_in != NULL;
+}
+
+/* Send one request line, recording when it was supposed to go out */
+void sendRequest(char* request, double when) {
+	pthread_mutex_lock(&progress_mutex);
+	long id = next_id++;
+	pthread_mutex_unlock(&progress_mutex);
+	if (id < max_ids)
+		intended[id] = when;
+	fprintf(server_in, "%s\n", request);
+	fflush(server_in);
+}
+
+/* Build a random request: a CHECK or a TRANS of 1 to 6 small transfers */
+void randomRequest(char* request) {
+	char part[32];
+	if ((int)(rand_r(&seed) % 100) < check_percent) {
+		sprintf(request, "CHECK %d", rand_r(&seed) % num_accounts + 1);
+		return;
+	}
+	int pairs = rand_r(&seed) % 6 + 1;
+	strcpy(request, "TRANS");
+	for (int i = 0; i < pairs; i++) {
+		sprintf(part, " %d %d", rand_r(&seed) % num_accounts + 1, (int)(rand_r(&seed) % 201) - 100);
+		strcat(request, part);
+	}
+}
+
+/* Parse one result line: "<id> <kind> [value] TIME <start> <end>" */
+void recordResult(char* line) {
+	char* parts[8];
+	int cnt = 0;
+	char* tok = strtok(line, " \n");
+	while (tok != NULL && cnt < 8) {
+		parts[cnt++] = tok;
+		tok = strtok(NULL, " \n");
+	}
+	if (cnt < 5)
+		return;
+	long id = atol(parts[0]);
+	if (id < 1 || id >= max_ids)
+		return;
+	srv_start[id] = atof(parts[cnt - 2]);
+	srv_end[id] = atof(parts[cnt - 1]);
+	if (strcmp(parts[1], "OK") == 0)
+		status[id] = STATUS_OK;
+	else if (strcmp(parts[1], "ISF") == 0)
+		status[id] = STATUS_ISF;
+	else if (strcmp(parts[1], "BAL") == 0)
+		status[id] = STATUS_BAL;
+	else
+		status[id] = STATUS_OTHER;
+
+	pthread_mutex_lock(&progress_mutex);
+	completed++;
+	pthread_cond_broadcast(&progress_cond);
+	pthread_mutex_unlock(&progress_mutex);
+}
+
+/* Follow the server's output file as it grows */
+void* readResults(void* arg) {
+	FILE* out = NULL;
+	char* line = NULL;
+	size_t len = 0;
+	(void)arg;
+
+	while (out == NULL && !atomic_load(&reader_stop)) {
+		out = fopen(output_path, "r");
+		if (out == NULL)
+			usleep(1000);
+	}
+	while (out != NULL) {
+		long pos = ftell(out);
+		ssize_t got = getline(&line, &len, out);
+		if (got > 0 && line[got - 1] == '\n') {
+			recordResult(line);
+			continue;
+		}
+		/* no complete line yet, wait for the server to write more */
+		if (atomic_load(&reader_stop))
+			break;
+		clearerr(out);
+		fseek(out, pos, SEEK_SET);
+		usleep(500);
+	}
+	free(line);
+	if (out != NULL)
+		fclose(out);
+	return NULL;
+}
+
+/* Wait until every request sent so far has a result, or the timeout passes */
+int drain(double timeout) {
+	double deadline = now() + timeout;
+	int done;
+	pthread_mutex_lock(&progress_mutex);
+	while (!(done = completed >= next_id - 1) && now() < deadline) {
+		struct timespec ts;
+		double t = now() + 0.05;
+		ts.tv_sec = (time_t)t;
+		ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+		pthread_cond_timedwait(&progress_cond, &progress_mutex, &ts);
+	}
+	pthread_mutex_unlock(&progress_mutex);
+	return done;
+}
+
+void doInitialDeposits() {
+	char request[400], part[32];
+	for (int i = 0; i < num_accounts; i += DEPOSIT_PAIRS) {
+		strcpy(request, "TRANS");
+		for (int j = i; j < i + DEPOSIT_PAIRS && j < num_accounts; j++) {
+			sprintf(part, " %d %d", j + 1, AMOUNT_INITIAL_DEPOSIT);
+			strcat(request, part);
+		}
+		sendRequest(request, now());
+	}
+	drain(DRAIN_TIMEOUT + num_accounts / 10);
+}
+
+/* Closed loop: keep [outstanding] requests in flight */
+void runClosed(long count) {
+	char request[400];
+	for (long i = 0; i < count; i++) {
+		pthread_mutex_lock(&progress_mutex);
+		while (next_id - 1 - completed >= outstanding)
+			pthread_cond_wait(&progress_cond, &progress_mutex);
+		pthread_mutex_unlock(&progress_mutex);
+		randomRequest(request);
+		sendRequest(request, now());
+	}
+}
+
+/* Open loop: Poisson arrivals at [per_sec], never waits for results */
+void runOpen(long count, double per_sec) {
+	char request[400];
+	double when = now();
+	for (long i = 0; i < count; i++) {
+		when += next_gap(per_sec);
+		sleep_until(when);
+		randomRequest(request);
+		sendRequest(request, when);
+	}
+}
+
+int compare_double(const void* a, const void* b) {
+	double x = *(double*)a;
+	double y = *(double*)b;
+	return (x > y) - (x < y);
+}
+
+double percentile(double* sorted, long cnt, double p) {
+	if (cnt == 0)
+		return 0;
+	long idx = (long)ceil(p / 100.0 * cnt) - 1;
+	if (idx < 0)
+		idx = 0;
+	return sorted[idx];
+}
+
+void writeLatencies(FILE* rep, char* name, double* lat, long cnt) {
+	qsort(lat, cnt, sizeof(double), compare_double);
+	fprintf(rep, "\"%s\": {\"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"p999\": %.6f, \"max\": %.6f}",
+		name, percentile(lat, cnt, 50), percentile(lat, cnt, 90), percentile(lat, cnt, 99),
+		percentile(lat, cnt, 99.9), cnt > 0 ? lat[cnt - 1] : 0);
+}
+
+/* Summarize requests [first, last) as one JSON object. Returns the completed throughput. */
+double writePhase(FILE* rep, char* name, double offered, long first, long last) {
+	long cnt = 0, counts[5] = {0};
+	double begin = 0, end = 0;
+	double* service = malloc((last - first + 1) * sizeof(double));
+	double* corrected = malloc((last - first + 1) * sizeof(double));
+
+	for (long id = first; id < last; id++) {
+		counts[(int)status[id]]++;
+		if (status[id] == STATUS_NONE)
+			continue;
+		service[cnt] = srv_end[id] - srv_start[id];
+		corrected[cnt] = srv_end[id] - intended[id];
+		if (begin == 0 || intended[id] < begin)
+			begin = intended[id];
+		if (srv_end[id] > end)
+			end = srv_end[id];
+		cnt++;
+	}
+	double duration = end > begin ? end - begin : 0;
+	double throughput = duration > 0 ? cnt / duration : 0;
+
+	fprintf(rep, "    {\"phase\": \"%s\", \"offered_rate\": %.2f, \"sent\": %ld, \"completed\": %ld, ",
+		name, offered, last - first, cnt);
+	fprintf(rep, "\"ok\": %ld, \"isf\": %ld, \"bal\": %ld, \"other\": %ld, ",
+		counts[STATUS_OK], counts[STATUS_ISF], counts[STATUS_BAL], counts[STATUS_OTHER]);
+	fprintf(rep, "\"duration_s\": %.3f, \"throughput\": %.2f,\n      ", duration, throughput);
+	writeLatencies(rep, "service_latency_s", service, cnt);
+	fprintf(rep, ",\n      ");
+	writeLatencies(rep, "corrected_latency_s", corrected, cnt);
+	fprintf(rep, "}");
+
+	printf("%-8s offered %8.1f/s  completed %6ld/%-6ld  throughput %8.1f/s  p99 %.3fs\n",
+		name, offered, cnt, last - first, throughput, percentile(corrected, cnt, 99));
+	free(service);
+	free(corrected);
+	return throughput;
+}
+
+void printUsage() {
+	printf("Usage: ./loadgen [program_path] [num_workers] [num_accounts] [closed|open|ramp] [options]\n");
+	printf("Options:\n");
+	printf("  %-22s: %s\n", "--requests=N", "requests to send in closed and open mode (default 2000)");
+	printf("  %-22s: %s\n", "--outstanding=N", "requests kept in flight in closed mode (default 16)");
+	printf("  %-22s: %s\n", "--rate=R", "requests per second in open mode (default 100)");
+	printf("  %-22s: %s\n", "--ramp-start=R", "first ramp rate (default 50)");
+	printf("  %-22s: %s\n", "--ramp-step=R", "rate added each ramp step (default 50)");
+	printf("  %-22s: %s\n", "--ramp-steps=N", "most ramp steps to run (default 10)");
+	printf("  %-22s: %s\n", "--step-secs=S", "length of each ramp step (default 5)");
+	printf("  %-22s: %s\n", "--check-percent=P", "share of CHECK requests (default 20)");
+	printf("  %-22s: %s\n", "--output=FILE", "server output file (default loadgen_results.txt)");
+	printf("  %-22s: %s\n", "--report=FILE", "JSON report (default loadgen_report.json)");
+	printf("  %-22s: %s\n", "--server-option=OPT", "pass OPT on to the server, may be repeated");
+}
+
+int parseOption(char* arg) {
+	char* val = strchr(arg, '=');
+	if (val == NULL)
+		return 0;
+	val++;
+	if (strncmp(arg, "--requests=", 11) == 0)
+		num_requests = atol(val);
+	else if (strncmp(arg, "--outstanding=", 14) == 0)
+		outstanding = atoi(val);
+	else if (strncmp(arg, "--rate=", 7) == 0)
+		rate = atof(val);
+	else if (strncmp(arg, "--ramp-start=", 13) == 0)
+		ramp_start = atof(val);
+	else if (strncmp(arg, "--ramp-step=", 12) == 0)
+		ramp_step = atof(val);
+	else if (strncmp(arg, "--ramp-steps=", 13) == 0)
+		ramp_steps = atoi(val);
+	else if (strncmp(arg, "--step-secs=", 12) == 0)
+		step_secs = atof(val);
+	else if (strncmp(arg, "--check-percent=", 16) == 0)
+		check_percent = atoi(val);
+	else if (strncmp(arg, "--output=", 9) == 0)
+		snprintf(output_path, sizeof(output_path), "%s", val);
+	else if (strncmp(arg, "--report=", 9) == 0)
+		snprintf(report_path, sizeof(report_path), "%s", val);
+	else if (strncmp(arg, "--server-option=", 16) == 0 && num_server_options < MAX_SERVER_OPTIONS)
+		server_options[num_server_options++] = val;
+	else
+		return 0;
+	return 1;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 5) {
+		printUsage();
+		return 0;
+	}
+	snprintf(program_path, sizeof(program_path), "%s", argv[1]);
+	num_workers = atoi(argv[2]);
+	num_accounts = atoi(argv[3]);
+	if (strcmp(argv[4], "closed") == 0)
+		mode = MODE_CLOSED;
+	else if (strcmp(argv[4], "open") == 0)
+		mode = MODE_OPEN;
+	else if (strcmp(argv[4], "ramp") == 0)
+		mode = MODE_RAMP;
+	else {
+		printUsage();
+		return 1;
+	}
+	for (int i = 5; i < argc; i++) {
+		if (!parseOption(argv[i])) {
+			printf("Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	/* size the bookkeeping for every request we might send */
+	long planned = num_requests;
+	if (mode == MODE_RAMP) {
+		planned = 0;
+		for (int s = 0; s < ramp_steps; s++)
+			planned += (long)((ramp_start + s * ramp_step) * step_secs) + 1;
+	}
+	max_ids = planned + num_accounts / DEPOSIT_PAIRS + 3;
+	intended = calloc(max_ids, sizeof(double));
+	srv_start = calloc(max_ids, sizeof(double));
+	srv_end = calloc(max_ids, sizeof(double));
+	status = calloc(max_ids, sizeof(char));
+
+	remove(output_path);
+	signal(SIGPIPE, SIG_IGN);
+	if (!startServer()) {
+		printf("Error: could not start %s\n", program_path);
+		return 1;
+	}
+	pthread_t reader;
+	pthread_create(&reader, NULL, readResults, NULL);
+
+	FILE* rep = fopen(report_path, "w");
+	if (rep == NULL) {
+		printf("Error: cannot write report %s\n", report_path);
+		return 1;
+	}
+	fprintf(rep, "{\n  \"program\": \"%s\", \"workers\": %d, \"accounts\": %d, \"mode\": \"%s\",\n  \"phases\": [\n",
+		program_path, num_workers, num_accounts, argv[4]);
+
+	printf("Making initial deposits to %d accounts...\n", num_accounts);
+	doInitialDeposits();
+	long first = next_id;
+
+	if (mode == MODE_CLOSED) {
+		runClosed(num_requests);
+		drain(DRAIN_TIMEOUT);
+		writePhase(rep, "closed", 0, first, next_id);
+	} else if (mode == MODE_OPEN) {
+		runOpen(num_requests, rate);
+		drain(DRAIN_TIMEOUT);
+		writePhase(rep, "open", rate, first, next_id);
+	} else {
+		double saturation = 0;
+		for (int s = 0; s < ramp_steps; s++) {
+			double step_rate = ramp_start + s * ramp_step;
+			char name[32];
+			sprintf(name, "step%d", s + 1);
+			first = next_id;
+			runOpen((long)(step_rate * step_secs), step_rate);
+			int drained = drain(DRAIN_TIMEOUT);
+			if (s > 0)
+				fprintf(rep, ",\n");
+			double throughput = writePhase(rep, name, step_rate, first, next_id);
+			if (!drained || throughput < RAMP_SATURATED * step_rate) {
+				saturation = step_rate;
+				break;
+			}
+		}
+		fprintf(rep, "\n  ],\n  \"saturation_rate\": %.2f\n}\n", saturation);
+		if (saturation > 0)
+			printf("Saturated at an offered rate of %.1f requests/s\n", saturation);
+		else
+			printf("Did not saturate, try a higher --ramp-start or --ramp-step\n");
+	}
+	if (mode != MODE_RAMP)
+		fprintf(rep, "\n  ]\n}\n");
+	fclose(rep);
+
+	/* shut the server down */
+	fprintf(server_in, "END\n");
+	fclose(server_in);
+	waitpid(server_pid, NULL, 0);
+	atomic_store(&reader_stop, 1);
+	pthread_join(reader, NULL);
+	printf("Report written to %s\n", report_path);
+
+	free(intended);
+	free(srv_start);
+	free(srv_end);
+	free(status);
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ *  Benchmark of the per-account lock implementations in AcctLock.h.
+ *
+ *  Every thread locks a random account out of a hot set, does a short
+ *  critical section and unlocks it, for a fixed amount of time. Each
+ *  lock type is run at 1, 2, 4, ... max_threads threads.
+ *
+ *  Usage: ./lock-bench [max_threads] [hot_accounts] [run_ms]
+ *  Output is CSV on stdout. ns_per_op is wall time per completed
+ *  acquire/release pair, fairness is the fewest operations any thread
+ *  finished divided by the most, 1.0 being perfectly fair.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "AcctLock.h"
+
+//Each configuration is timed this many times and the median is reported
+#define REPEATS 3
+
+#define TYPE_SEM 0
+#define TYPE_FUTEX 1
+#define TYPE_MCS 2
+#define NUM_TYPES 3
+
+//Locks padded to a cache line so only the lock itself is being measured
+struct padded_lock {
+    union {
+        sem_t sem;
+        futex_lock_t futex;
+        mcs_lock_t mcs;
+    } u;
+    long counter;
+} __attribute__((aligned(64)));
+
+int hot_accounts = 1;
+long run_ms = 200;
+int lock_type;
+volatile int running;
+struct padded_lock* locks;
+
+uint32_t next_rand(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+void* run_thread(void* arg) {
+    long* ops = (long*)arg;
+    uint32_t seed = (uint32_t)(long)ops * 2654435761u + 1;
+    struct acct_lock_node node;
+    //Counted locally, the ops of all threads share cache lines
+    long done = 0;
+
+    while (running) {
+        struct padded_lock* l = &locks[next_rand(&seed) % hot_accounts];
+        if (lock_type == TYPE_SEM) {
+            sem_lock_acquire(&l->u.sem, &node);
+            l->counter++;
+            sem_lock_release(&l->u.sem, &node);
+        } else if (lock_type == TYPE_FUTEX) {
+            futex_lock_acquire(&l->u.futex, &node);
+            l->counter++;
+            futex_lock_release(&l->u.futex, &node);
+        } else {
+            mcs_lock_acquire(&l->u.mcs, &node);
+            l->counter++;
+            mcs_lock_release(&l->u.mcs, &node);
+        }
+        done++;
+    }
+    *ops = done;
+    return NULL;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//Run one configuration, fills in ns per operation and fairness
+void run_once(int threads, double* ns_per_op, double* fairness) {
+    pthread_t tids[threads];
+    long ops[threads];
+    long total = 0, counted = 0, min = -1, max = 0;
+    struct timespec run = {run_ms / 1000, (run_ms % 1000) * 1000000};
+
+    for (int i = 0; i < hot_accounts; i++) {
+        if (lock_type == TYPE_SEM) {
+            sem_lock_init(&locks[i].u.sem);
+        } else if (lock_type == TYPE_FUTEX) {
+            futex_lock_init(&locks[i].u.futex);
+        } else {
+            mcs_lock_init(&locks[i].u.mcs);
+        }
+        locks[i].counter = 0;
+    }
+
+    running = 1;
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        ops[i] = 0;
+        pthread_create(&tids[i], NULL, run_thread, &ops[i]);
+    }
+    nanosleep(&run, NULL);
+    running = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    for (int i = 0; i < threads; i++) {
+        total += ops[i];
+        if (min < 0 || ops[i] < min)
+            min = ops[i];
+        if (ops[i] > max)
+            max = ops[i];
+    }
+    //Make sure the lock actually protected the counters
+    for (int i = 0; i < hot_accounts; i++) {
+        counted += locks[i].counter;
+    }
+    if (counted != total) {
+        fprintf(stderr, "ERROR: lost updates, expected %ld got %ld\n", total, counted);
+        exit(1);
+    }
+    *ns_per_op = total > 0 ? elapsed / total : 0;
+    *fairness = max > 0 ? (double)min / max : 0;
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(double*)a;
+    double y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = 64;
+    char* names[] = {"sem", "futex", "mcs"};
+    int sizes[] = {sizeof(sem_t), sizeof(futex_lock_t), sizeof(mcs_lock_t)};
+
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        hot_accounts = atoi(argv[2]);
+    if (argc > 3)
+        run_ms = atol(argv[3]);
+
+    if (posix_memalign((void**)&locks, 64, hot_accounts * sizeof(struct padded_lock)) != 0) {
+        printf("ERROR: Could not allocate locks\n");
+        return 1;
+    }
+
+    printf("lock,lock_bytes,threads,hot_accounts,ns_per_op,fairness\n");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        for (lock_type = 0; lock_type < NUM_TYPES; lock_type++) {
+            double ns[REPEATS], fair[REPEATS];
+            for (int r = 0; r < REPEATS; r++) {
+                run_once(threads, &ns[r], &fair[r]);
+            }
+            qsort(ns, REPEATS, sizeof(double), compare_double);
+            qsort(fair, REPEATS, sizeof(double), compare_double);
+            printf("%s,%d,%d,%d,%.1f,%.3f\n", names[lock_type], sizes[lock_type], threads, hot_accounts, ns[REPEATS / 2], fair[REPEATS / 2]);
+            fflush(stdout);
+        }
+    }
+
+    free(locks);
+    return 0;
+}
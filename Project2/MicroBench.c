@@ -0,0 +1,256 @@
+/*
+ *  Microbenchmarks of the bank server building blocks, each run in isolation
+ *  on the real code: BankServer.c is included with BANK_BENCH defined, which
+ *  leaves out its main(), and built with the same flags as appserver.
+ *
+ *  queue   queue_add + lanes_pop pairs under queue_mutex, at 1 to max_threads
+ *  parse   create_trans on CHECK and TRANS lines read from memory
+ *  sort    sort_transactions on random pair lists
+ *  lock    uncontended acquire + release of an account lock (see lock-bench
+ *          for contended locks)
+ *  format  log_result lines written to /dev/null
+ *
+ *  Usage: ./micro-bench [max_threads] [run_ms]
+ *  Output is CSV on stdout, one row per benchmark: ns_per_op is the median of
+ *  REPEATS timed runs and spread is (max - min) / median of those runs, so
+ *  noisy rows stand out when comparing two commits.
+ */
+
+#include "BankServer.c"
+
+//Each benchmark is timed this many times and the median is reported
+#define REPEATS 5
+#define PARSE_LINES 4096
+#define SORT_ARRAYS 256
+
+long bench_run_ms = 100;
+volatile int bench_running;
+
+int64_t bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(double*)a;
+    double y = *(double*)b;
+    return (x > y) - (x < y);
+}
+
+void report(char* bench, char* variant, int threads, double* samples, long ops) {
+    qsort(samples, REPEATS, sizeof(double), compare_double);
+    double median = samples[REPEATS / 2];
+    printf("%s,%s,%d,%ld,%.1f,%.3f\n", bench, variant, threads, ops, median,
+           median > 0 ? (samples[REPEATS - 1] - samples[0]) / median : 0);
+}
+
+//--------------Queue--------------
+void* queue_thread(void* arg) {
+    long* ops = (long*)arg;
+    //Counted locally, the ops of all threads share cache lines
+    long done = 0;
+    struct request req;
+    memset(&req, 0, sizeof(req));
+    req.balchk_id = 1;
+    gettimeofday(&req.start, NULL);
+
+    while (bench_running) {
+        sem_wait(queue_mutex);
+        queue_add(&lanes[LANE_FAST], &req);
+        lanes_pop();
+        sem_post(queue_mutex);
+        done++;
+    }
+    *ops = done;
+    return NULL;
+}
+
+void bench_queue(int max_threads) {
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double samples[REPEATS];
+        long total = 0;
+        for (int r = 0; r < REPEATS; r++) {
+            pthread_t tids[threads];
+            long ops[threads];
+            bench_running = 1;
+            int64_t start = bench_now();
+            for (int t = 0; t < threads; t++) {
+                ops[t] = 0;
+                pthread_create(&tids[t], NULL, queue_thread, &ops[t]);
+            }
+            struct timespec run = {bench_run_ms / 1000, (bench_run_ms % 1000) * 1000000};
+            nanosleep(&run, NULL);
+            bench_running = 0;
+            total = 0;
+            for (int t = 0; t < threads; t++) {
+                pthread_join(tids[t], NULL);
+                total += ops[t];
+            }
+            samples[r] = (double)(bench_now() - start) / (total > 0 ? total : 1);
+        }
+        report("queue", "add_pop", threads, samples, total);
+    }
+}
+
+//--------------Parse--------------
+//Request lines with pairs TRANS pairs each, or CHECKs if pairs is 0
+char* make_requests(int pairs, size_t* len) {
+    char* buf = malloc(PARSE_LINES * (pairs * 24 + 32));
+    uint32_t seed = 12345;
+    *len = 0;
+    for (int i = 0; i < PARSE_LINES; i++) {
+        if (pairs == 0) {
+            *len += sprintf(buf + *len, "CHECK %d\n", rand_r(&seed) % 1000 + 1);
+            continue;
+        }
+        *len += sprintf(buf + *len, "TRANS");
+        for (int p = 0; p < pairs; p++) {
+            *len += sprintf(buf + *len, " %d %d", rand_r(&seed) % 1000 + 1, rand_r(&seed) % 200 - 100);
+        }
+        buf[(*len)++] = '\n';
+    }
+    return buf;
+}
+
+void drain_lanes() {
+    struct request* req;
+    while ((req = lanes_pop()) != NULL) {
+        free_request(req);
+        sem_trywait(jobs_avail);
+    }
+}
+
+void bench_parse(char* variant, int pairs) {
+    size_t len;
+    char* text = make_requests(pairs, &len);
+    double samples[REPEATS];
+
+    //create_trans announces every request ID on stdout, keep that out of the CSV
+    fflush(stdout);
+    int saved = dup(1);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    for (int r = 0; r < REPEATS; r++) {
+        FILE* in = fmemopen(text, len, "r");
+        int64_t start = bench_now();
+        for (int i = 0; i < PARSE_LINES; i++) {
+            create_trans(in);
+        }
+        samples[r] = (double)(bench_now() - start) / PARSE_LINES;
+        fclose(in);
+        drain_lanes();
+    }
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    close(devnull);
+    report("parse", variant, 1, samples, PARSE_LINES);
+    free(text);
+}
+
+//--------------Sort--------------
+void bench_sort(char* variant, int pairs) {
+    struct transaction* src = malloc(SORT_ARRAYS * pairs * sizeof(struct transaction));
+    struct transaction* work = malloc(SORT_ARRAYS * pairs * sizeof(struct transaction));
+    uint32_t seed = 777;
+    double samples[REPEATS];
+
+    for (int i = 0; i < SORT_ARRAYS * pairs; i++) {
+        src[i].acc_id = rand_r(&seed) % 100000 + 1;
+        src[i].amount = 1;
+    }
+    for (int r = 0; r < REPEATS; r++) {
+        memcpy(work, src, SORT_ARRAYS * pairs * sizeof(struct transaction));
+        int64_t start = bench_now();
+        for (int a = 0; a < SORT_ARRAYS; a++) {
+            sort_transactions(work + a * pairs, pairs);
+        }
+        samples[r] = (double)(bench_now() - start) / SORT_ARRAYS;
+    }
+    report("sort", variant, 1, samples, SORT_ARRAYS);
+    free(src);
+    free(work);
+}
+
+//--------------Lock--------------
+void bench_lock() {
+    struct acct_lock_node node;
+    long ops = 1000000;
+    double samples[REPEATS];
+
+    for (int r = 0; r < REPEATS; r++) {
+        int64_t start = bench_now();
+        for (long i = 0; i < ops; i++) {
+            acct_lock_acquire(&accounts[0].lock, &node);
+            acct_lock_release(&accounts[0].lock, &node);
+        }
+        samples[r] = (double)(bench_now() - start) / ops;
+    }
+    report("lock", ACCT_LOCK_NAME, 1, samples, ops);
+}
+
+//--------------Format--------------
+void bench_format(char* variant, int result) {
+    struct request req;
+    long ops = 200000;
+    double samples[REPEATS];
+
+    memset(&req, 0, sizeof(req));
+    req.request_id = 123456;
+    gettimeofday(&req.start, NULL);
+    for (int r = 0; r < REPEATS; r++) {
+        int64_t start = bench_now();
+        for (long i = 0; i < ops; i++) {
+            log_result(&req, result, 98765);
+        }
+        fflush(output);
+        samples[r] = (double)(bench_now() - start) / ops;
+    }
+    report("format", variant, 1, samples, ops);
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = 4;
+    if (argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        bench_run_ms = atol(argv[2]);
+    }
+
+    //The parts of the server setup the benchmarks touch
+    num_accounts = 1000;
+    accounts = (struct account*)affinity_alloc(num_accounts * sizeof(struct account));
+    for (int i = 0; i < num_accounts; i++) {
+        acct_lock_init(&accounts[i].lock);
+        accounts[i].balance = 0;
+        accounts[i].version = 0;
+    }
+    lanes = calloc(NUM_LANES, sizeof(struct queue));
+    queue_mutex = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(queue_mutex, 0, 1);
+    jobs_avail = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(jobs_avail, 0, 0);
+    output = fopen("/dev/null", "w");
+    if (accounts == NULL || output == NULL) {
+        printf("ERROR: Could not set up the benchmarks\n");
+        return 1;
+    }
+
+    printf("bench,variant,threads,ops,ns_per_op,spread\n");
+    bench_queue(max_threads);
+    bench_parse("check", 0);
+    bench_parse("trans_2", 2);
+    bench_parse("trans_8", 8);
+    bench_sort("pairs_2", 2);
+    bench_sort("pairs_8", 8);
+    bench_sort("pairs_64", 64);
+    bench_lock();
+    bench_format("ok", RESULT_OK);
+    bench_format("bal", RESULT_BAL);
+    bench_format("isf", RESULT_ISF);
+
+    fclose(output);
+    return 0;
+}
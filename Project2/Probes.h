@@ -0,0 +1,42 @@
+/*
+ *  Static tracepoints (USDT) on the request lifecycle of the bank server.
+ *
+ *  Every probe is in the "bank" provider, arguments are integers:
+ *
+ *  enqueue(request_id, lane)          request parsed and queued by create_trans()
+ *  dequeue(request_id, batch_size)    worker took the request and its batch
+ *  lock_acquired(request_id, locks)   all locks of a CHECK or TRANS batch are held
+ *  read_start(account)                storage read issued
+ *  read_end(account, balance)
+ *  write_start(account, balance)      storage write issued
+ *  write_end(account)
+ *  commit(request_id, accounts)       new balances installed for a batch
+ *  isf(request_id, account)           TRANS rejected for insufficient funds
+ *  result(request_id, result)         result line written, a RESULT_* kind
+ *
+ *  With <sys/sdt.h> available each probe compiles to a single nop plus an ELF
+ *  note, so they cost nothing until bpftrace or perf attaches, e.g.
+ *  bpftrace -l 'usdt:./appserver:bank:*'. See probes/ for ready-made scripts.
+ *  Build with -DBANK_NO_USDT, or without sys/sdt.h, and they compile away.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(BANK_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BANK_USDT 1
+#endif
+#endif
+
+#ifdef BANK_USDT
+#define BANK_PROBE1(name, a) DTRACE_PROBE1(bank, name, a)
+#define BANK_PROBE2(name, a, b) DTRACE_PROBE2(bank, name, a, b)
+#else
+//Still evaluate the arguments, values computed only for a probe stay used
+#define BANK_PROBE1(name, a) do { (void)(a); } while (0)
+#define BANK_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#endif
+
+#endif
@@ -33,6 +33,17 @@ program to be printed out in the right place
 /* seed for the Random Number Generator */
 #define RNG_SEED 5
 
+/* most pairs a generated TRANS request may contain */
+#define MAX_PAIRS 64
+
+/* picks of an account already in the TRANS before taking the next free one instead */
+#define MAX_PICK_TRIES 100
+
+/* distributions for the number of pairs in a random TRANS */
+#define PAIRS_UNIFORM 0
+#define PAIRS_FIXED 1
+#define PAIRS_GEOMETRIC 2
+
 /* Functions for the testing process */
 void startTesting();
 int doInitialDeposits(FILE*, int*, int); // step 1
@@ -42,6 +53,12 @@ void doFinalBalanceCheck(FILE*); // step 5
 void endProgram(FILE*); // step 6
 void analyzeOutputFile(int*, int*, int, int); // step 7
 
+/* Workload profile for the random transactions in step 3 */
+int parseProfileOption(char*);
+void setupProfile();
+int pickAccount();
+int pickNumPairs();
+
 /* Helper functions */
 void printUsage();
 void printFormatError(int, char*);
@@ -56,26 +73,58 @@ int num_accounts = 1000;
 int wait_time_initial = 20;
 int wait_time_final = 30;
 int secret_trans_count = 0;
+
+/* workload profile, the defaults reproduce the original uniform workload */
+double zipf_theta = 0;        /* Zipfian skew over account IDs, 0 for none */
+int hot_account_percent = 0;  /* size of the hot set as a share of all accounts */
+int hot_traffic_percent = 0;  /* share of account picks that go to the hot set */
+int check_percent = 0;        /* share of the random requests that are CHECK */
+double isf_percent = 1;       /* share of the random TRANS that should be ISF */
+int pair_dist = PAIRS_UNIFORM;
+int min_pairs = 1;
+int max_pairs = 6;
+double mean_pairs = 3;
+double *zipf_cdf = NULL;
+
+/* filled in by doRandomTrans for the analysis */
+int num_random_checks = 0;
+int num_isf_planned = 0;
 	
 int main(int argc, char** argv) {
+	char *args[argc];
+	int num_args = 0;
 
-	if (argc < 2) {
+	/* profile options may appear anywhere, the rest are positional */
+	for (int i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2) == 0) {
+			if (!parseProfileOption(argv[i])) {
+				printf("Unknown or malformed option %s\n\n", argv[i]);
+				printUsage();
+				return 1;
+			}
+		} else {
+			args[num_args++] = argv[i];
+		}
+	}
+
+	if (num_args < 2) {
 		printUsage();
 		return 0;
 	};
 
 	/* Initialize testing parameters */
-	strcpy(program_path, argv[1]);
-	if (argc > 2)
-		num_workers = atoi(argv[2]);
-	if (argc > 3)
-		num_accounts = atoi(argv[3]);
-	if (argc > 4)
-		wait_time_initial = atoi(argv[4]);
-	if (argc > 5)
-		wait_time_final = atoi(argv[5]);
-	if (argc > 6)
-		secret_trans_count =atoi(argv[6]);
+	strcpy(program_path, args[1]);
+	if (num_args > 2)
+		num_workers = atoi(args[2]);
+	if (num_args > 3)
+		num_accounts = atoi(args[3]);
+	if (num_args > 4)
+		wait_time_initial = atoi(args[4]);
+	if (num_args > 5)
+		wait_time_final = atoi(args[5]);
+	if (num_args > 6)
+		secret_trans_count =atoi(args[6]);
+	setupProfile();
 	sprintf(output_path, "test_%d_%d.txt", num_workers, num_accounts);
 
 	startTesting();
@@ -157,21 +206,38 @@ int doInitialDeposits(FILE* pipe, int *expected_balances, int accounts_per_trans
 
 int* doRandomTrans(FILE* pipe, int *balances, int num_trans) {
 	int i, j;
-	char request[300], part[25];
+	char request[MAX_PAIRS * 25 + 10], part[25];
 	// initialize RNG with seed
 	srand(RNG_SEED);
 	
-	// 1% of the random TRANS should be ISF
-	int num_isf = num_trans / 100;
-	if (num_trans > 1 && num_isf == 0)
+	// decide which of the random requests are CHECK instead of TRANS
+	char *isCheck = (char*) calloc(num_trans, sizeof(char));
+	num_random_checks = 0;
+	if (check_percent > 0) {
+		for (i = 0; i < num_trans; i++) {
+			if (RAND(0, 100) < check_percent) {
+				isCheck[i] = 1;
+				num_random_checks++;
+			}
+		}
+	}
+	int num_random_trans = num_trans - num_random_checks;
+	
+	// isf_percent (1% by default) of the random TRANS should be ISF
+	int num_isf = (int)(num_random_trans * isf_percent / 100);
+	if (isf_percent > 0 && num_random_trans > 1 && num_isf == 0)
 		num_isf = 1;
+	// ISF requests need 6 distinct accounts
+	if (num_accounts < 6)
+		num_isf = 0;
+	num_isf_planned = num_isf;
 	
 	// determine which TRANS requests should be ISF
-	int *isf_req_ids = (int*) malloc(num_isf * sizeof(int));
+	int *isf_req_ids = (int*) malloc((num_isf > 0 ? num_isf : 1) * sizeof(int));
 	char *shouldISF = (char*) calloc(num_trans, sizeof(char));
 	while (num_isf > 0) {
 		i = RAND(0, num_trans);
-		if (!shouldISF[i]) {
+		if (!shouldISF[i] && !isCheck[i]) {
 			shouldISF[i] = 1;
 			num_isf--;
 		}
@@ -185,9 +251,17 @@ int* doRandomTrans(FILE* pipe, int *balances, int num_trans) {
 	// generate TRANS requests
 	for (i = 0; i < num_trans; i++) {
 		
-		// each TRANS contains 1 to 6 pairs of accounts
-		// TRANS with always have 6 pairs
-		int num_pairs = shouldISF[i]? 6 : RAND(1, 7);
+		if (isCheck[i]) {
+			sprintf(request, "CHECK %d", pickAccount()+1);
+			printf("%s\n", request);
+			fprintf(pipe, "%s\n", request);
+			usleep(REQUEST_INTERVAL);
+			continue;
+		}
+		
+		// each TRANS contains 1 to 6 pairs of accounts by default
+		// ISF TRANS will always have 6 pairs
+		int num_pairs = shouldISF[i]? MIN(6, num_accounts) : pickNumPairs();
 		int acc_ids[num_pairs];
 		
 		if (shouldISF[i])
@@ -196,12 +270,13 @@ int* doRandomTrans(FILE* pipe, int *balances, int num_trans) {
 		sprintf(request, "TRANS");
 		for (j = 0; j < num_pairs; j++) {
 			// generate random account id
-			int acc_id = RAND(0, num_accounts);
-			// avoid duplicate accounts IDs in the same TRANS request
-			if (acc_included[acc_id]) {
-				j--;
-				continue;
-			}
+			int acc_id = pickAccount();
+			// avoid duplicate accounts IDs in the same TRANS request, a hot set
+			// smaller than the request runs out of accounts to pick
+			for (int tries = 1; acc_included[acc_id] && tries < MAX_PICK_TRIES; tries++)
+				acc_id = pickAccount();
+			while (acc_included[acc_id])
+				acc_id = (acc_id + 1) % num_accounts;
 			acc_included[acc_id] = 1;
 			acc_ids[j] = acc_id;
 			
@@ -230,11 +305,115 @@ int* doRandomTrans(FILE* pipe, int *balances, int num_trans) {
 	}
 	
 	free(shouldISF);
+	free(isCheck);
 	free(acc_included);
 	
 	return isf_req_ids;
 }
 
+/* Parse one of the workload profile options, returns 0 if it is not one or its value is out of range */
+int parseProfileOption(char *arg) {
+	char *val = strchr(arg, '=');
+	if (val == NULL)
+		return 0;
+	val++;
+	if (strncmp(arg, "--zipf=", 7) == 0) {
+		zipf_theta = atof(val);
+		return zipf_theta >= 0;
+	}
+	else if (strncmp(arg, "--hot-set=", 10) == 0)
+		return sscanf(val, "%d:%d", &hot_account_percent, &hot_traffic_percent) == 2 &&
+			hot_account_percent > 0 && hot_account_percent < 100 &&
+			hot_traffic_percent >= 0 && hot_traffic_percent <= 100;
+	else if (strncmp(arg, "--check-percent=", 16) == 0) {
+		check_percent = atoi(val);
+		return check_percent >= 0 && check_percent <= 100;
+	}
+	else if (strncmp(arg, "--isf-percent=", 14) == 0) {
+		isf_percent = atof(val);
+		return isf_percent >= 0 && isf_percent <= 100;
+	}
+	else if (strncmp(arg, "--pairs=", 8) == 0) {
+		if (sscanf(val, "uniform:%d-%d", &min_pairs, &max_pairs) == 2)
+			pair_dist = PAIRS_UNIFORM;
+		else if (sscanf(val, "fixed:%d", &min_pairs) == 1) {
+			pair_dist = PAIRS_FIXED;
+			max_pairs = min_pairs;
+		}
+		else if (sscanf(val, "geometric:%lf", &mean_pairs) == 1 && mean_pairs >= 1) {
+			pair_dist = PAIRS_GEOMETRIC;
+			min_pairs = 1;
+		}
+		else
+			return 0;
+		return min_pairs >= 1 && min_pairs <= max_pairs && max_pairs <= MAX_PAIRS;
+	}
+	return 0;
+}
+
+/* Validate the profile and precompute the Zipf distribution */
+void setupProfile() {
+	int i;
+	int pair_cap = MIN(MAX_PAIRS, num_accounts);
+	if (max_pairs > pair_cap)
+		max_pairs = pair_cap;
+	if (min_pairs > max_pairs)
+		min_pairs = max_pairs;
+	if (min_pairs < 1)
+		min_pairs = 1;
+	if (hot_account_percent <= 0 || hot_account_percent >= 100 || hot_traffic_percent <= 0)
+		hot_account_percent = 0;
+	
+	if (zipf_theta > 0) {
+		// P(rank k) is proportional to 1/k^theta, account k-1 has rank k
+		zipf_cdf = (double*) malloc(num_accounts * sizeof(double));
+		double total = 0;
+		for (i = 0; i < num_accounts; i++) {
+			total += 1.0 / pow(i + 1, zipf_theta);
+			zipf_cdf[i] = total;
+		}
+		for (i = 0; i < num_accounts; i++)
+			zipf_cdf[i] /= total;
+	}
+}
+
+/* Pick a 0-based account according to the profile */
+int pickAccount() {
+	if (zipf_cdf != NULL) {
+		double u = (double) rand() / ((double) RAND_MAX + 1);
+		int lo = 0, hi = num_accounts - 1;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (zipf_cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+	if (hot_account_percent > 0) {
+		int hot = MAX(1, num_accounts * hot_account_percent / 100);
+		if (RAND(0, 100) < hot_traffic_percent || hot == num_accounts)
+			return RAND(0, hot);
+		return RAND(hot, num_accounts);
+	}
+	return RAND(0, num_accounts);
+}
+
+/* Pick how many pairs the next non-ISF TRANS gets */
+int pickNumPairs() {
+	if (pair_dist == PAIRS_FIXED)
+		return min_pairs;
+	if (pair_dist == PAIRS_GEOMETRIC) {
+		// number of trials until the first success with p = 1/mean
+		int pairs = 1;
+		while (pairs < max_pairs && (double) rand() / RAND_MAX > 1.0 / mean_pairs)
+			pairs++;
+		return pairs;
+	}
+	return RAND(min_pairs, max_pairs + 1);
+}
+
 void doFinalBalanceCheck(FILE *pipe) {
 	char request[20];
 	int i;
@@ -251,11 +430,10 @@ void analyzeOutputFile(int *expected_balances, int *expected_isf_req_ids, int nu
 	
 	int i;
 	int num_req_total = num_trans_initial + num_trans_random + num_accounts;
-	int num_trans = num_trans_initial + num_trans_random;
+	int num_trans = num_trans_initial + num_trans_random - num_random_checks;
+	int num_checks = num_accounts + num_random_checks;
 	int lineNumber = 0;
-	int num_isf_expected = num_trans_random / 100;
-	if (num_trans_random > 1 && num_isf_expected == 0)
-		num_isf_expected = 1;
+	int num_isf_expected = num_isf_planned;
 	int num_isf_actual = 0;
 	int actual_isf_req_ids[num_trans_random];
 	int sum_actual_balance = 0;
@@ -287,7 +465,7 @@ void analyzeOutputFile(int *expected_balances, int *expected_isf_req_ids, int nu
 	printf("============== Test Summary =================\n");
 	printf("\nBank program parameters: %d worker threads, %d bank accounts\n", num_workers, num_accounts);
 	printf("Output file path: %s\n", output_path);
-	printf("Total number of requests generated: %d (%d TRANS, %d CHECK)\n", num_req_total, num_trans, num_accounts);
+	printf("Total number of requests generated: %d (%d TRANS, %d CHECK)\n", num_req_total, num_trans, num_checks);
 	
 	
 	// For each line in output file:
@@ -367,7 +545,9 @@ void analyzeOutputFile(int *expected_balances, int *expected_isf_req_ids, int nu
 				format_OK = 0;
 				break;
 			}
-			sum_actual_balance += balance;
+			// only the final balance checks count towards the sum
+			if (req_id > num_trans_initial + num_trans_random)
+				sum_actual_balance += balance;
 		}
 		// check time: end time should be greater than start time
 		double start, end;
@@ -471,10 +651,10 @@ void analyzeOutputFile(int *expected_balances, int *expected_isf_req_ids, int nu
 	//printf("Final balance checks(%d CHECK) took %.1f seconds to finish\n", num_accounts, time_final_bal);
 	
 	double avg_time_trans = total_time_trans / num_trans;
-	double avg_time_check = total_time_check / num_accounts;
+	double avg_time_check = total_time_check / num_checks;
 	printf("\n-- Request Wait Time --\n");
 	printf("Total wait time for the %d TRANS requests: %.3f seconds, average %.3f seconds per request\n", num_trans, total_time_trans, avg_time_trans);
-	printf("Total wait time for the %d CHECK requests: %.3f seconds, average %.3f seconds per request\n\n", num_accounts, total_time_check, avg_time_check);
+	printf("Total wait time for the %d CHECK requests: %.3f seconds, average %.3f seconds per request\n\n", num_checks, total_time_check, avg_time_check);
 	
 	free(parts);
 	free(req_answered);
@@ -502,17 +682,23 @@ void endProgram(FILE* pipe) {
 }
 
 void printUsage() {
-	printf("Usage: ./Project2Test [program_path] [num_workers] [num_accounts] [wait_time_initial] [wait_time_final]\n");
+	printf("Usage: ./Project2Test [program_path] [num_workers] [num_accounts] [wait_time_initial] [wait_time_final] [--profile options]\n");
 	printf("Parameter:\n");
 	printf("  %-18s: %s\n", "program_path", "path to the bank server program");
 	printf("  %-18s: %s\n", "num_workers", "optional paramter (default 10). Number of worker threads for the bank server");
 	printf("  %-18s: %s\n", "num_accounts", "optional paramter (default 1000). Number of bank accounts for the bank server");
 	printf("  %-18s: %s\n", "wait_time_initial", "optional parameter (default 15). Wait time (in seconds) after initial deposits. ");
 	printf("  %-18s: %s\n", "wait_time_final", "optional parameter (default 20). Wait time (in seconds) before final balance checking");
+	printf("Workload profile options for Step 3 (defaults give uniform accounts, 1-6 pairs, 1%% ISF):\n");
+	printf("  %-18s: %s\n", "--zipf=THETA", "pick accounts with Zipfian skew, account 1 being the hottest (e.g. 0.99)");
+	printf("  %-18s: %s\n", "--hot-set=A:T", "A%% of the accounts receive T%% of the account picks");
+	printf("  %-18s: %s\n", "--check-percent=P", "P%% of the random requests are CHECK instead of TRANS");
+	printf("  %-18s: %s\n", "--pairs=DIST", "pairs per TRANS: uniform:MIN-MAX, fixed:N or geometric:MEAN (at most 64)");
+	printf("  %-18s: %s\n", "--isf-percent=P", "P%% of the random TRANS are made to cause ISF");
 	printf("\nThis script tests your bank server program in 7 steps:\n");
 	printf("  Step 1: Deposit %d to each bank account\n", AMOUNT_INITIAL_DEPOSIT);
 	printf("  Step 2: Wait for [wait_time_initial] seconds to let all the Step 1 transactions finish\n");
-	printf("  Step 3: Make at least %d randomly generated TRANS requests. A small percentage of them might cause ISF.\n", MIN_RANDOM_TRANS);
+	printf("  Step 3: Make at least %d randomly generated requests following the workload profile. A small percentage of them might cause ISF.\n", MIN_RANDOM_TRANS);
 	printf("  Step 4: Wait for [wait_time_final] seconds to let all the Step 3 transactions finish\n");
 	printf("  Step 5: Check all the account balances\n");
 	printf("  Step 6: Send the END command and wait for program to finish\n");
@@ -0,0 +1,120 @@
+#include "Ranking.h"
+#include <stdlib.h>
+
+//Is account a ordered before account b?
+static int rank_less(struct ranking* r, int a, int b) {
+    int64_t x = r->node[a].balance;
+    int64_t y = r->node[b].balance;
+    return x < y || (x == y && a < b);
+}
+
+//Split t into the accounts ordered before x and the rest
+static void rank_split(struct ranking* r, int t, int x, int* left, int* right) {
+    if (t == 0) {
+        *left = 0;
+        *right = 0;
+    } else if (rank_less(r, t, x)) {
+        rank_split(r, r->node[t].right, x, &r->node[t].right, right);
+        *left = t;
+    } else {
+        rank_split(r, r->node[t].left, x, left, &r->node[t].left);
+        *right = t;
+    }
+}
+
+//Join two treaps where every account of a is ordered before every account of b
+static int rank_merge(struct ranking* r, int a, int b) {
+    if (a == 0 || b == 0) {
+        return a ? a : b;
+    }
+    if (r->node[a].priority > r->node[b].priority) {
+        r->node[a].right = rank_merge(r, r->node[a].right, b);
+        return a;
+    }
+    r->node[b].left = rank_merge(r, a, r->node[b].left);
+    return b;
+}
+
+static int rank_insert(struct ranking* r, int t, int x) {
+    if (t == 0) {
+        return x;
+    }
+    if (r->node[x].priority > r->node[t].priority) {
+        rank_split(r, t, x, &r->node[x].left, &r->node[x].right);
+        return x;
+    }
+    if (rank_less(r, x, t)) {
+        r->node[t].left = rank_insert(r, r->node[t].left, x);
+    } else {
+        r->node[t].right = rank_insert(r, r->node[t].right, x);
+    }
+    return t;
+}
+
+//Remove x, which must be in t with its current balance
+static int rank_erase(struct ranking* r, int t, int x) {
+    if (t == x) {
+        return rank_merge(r, r->node[t].left, r->node[t].right);
+    }
+    if (rank_less(r, x, t)) {
+        r->node[t].left = rank_erase(r, r->node[t].left, x);
+    } else {
+        r->node[t].right = rank_erase(r, r->node[t].right, x);
+    }
+    return t;
+}
+
+//In-order walk from the largest or smallest end, stops once cnt reaches k
+static void rank_collect(struct ranking* r, int t, int k, int largest, int* ids, int64_t* balances, int* cnt) {
+    if (t == 0 || *cnt >= k) {
+        return;
+    }
+    rank_collect(r, largest ? r->node[t].right : r->node[t].left, k, largest, ids, balances, cnt);
+    if (*cnt < k) {
+        ids[*cnt] = t;
+        balances[*cnt] = r->node[t].balance;
+        (*cnt)++;
+    }
+    rank_collect(r, largest ? r->node[t].left : r->node[t].right, k, largest, ids, balances, cnt);
+}
+
+int ranking_init( struct ranking* r, int n ) {
+    uint32_t seed = 2463534242u;
+    r->n = n;
+    r->root = 0;
+    r->node = (struct rank_node*)calloc(n + 1, sizeof(struct rank_node));
+    if (r->node == NULL) {
+        return 0;
+    }
+    for (int i = 1; i <= n; i++) {
+        //xorshift32, the priorities only need to look random to keep the treap balanced
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        r->node[i].priority = seed;
+        r->root = rank_insert(r, r->root, i);
+    }
+    return 1;
+}
+
+void ranking_update( struct ranking* r, int id, int64_t balance ) {
+    if (r->node[id].balance == balance) {
+        return;
+    }
+    r->root = rank_erase(r, r->root, id);
+    r->node[id].balance = balance;
+    r->node[id].left = 0;
+    r->node[id].right = 0;
+    r->root = rank_insert(r, r->root, id);
+}
+
+int ranking_top( struct ranking* r, int k, int largest, int* ids, int64_t* balances ) {
+    int cnt = 0;
+    rank_collect(r, r->root, k, largest, ids, balances, &cnt);
+    return cnt;
+}
+
+void ranking_free( struct ranking* r ) {
+    free(r->node);
+    r->node = NULL;
+}
@@ -0,0 +1,56 @@
+/*
+ *  Accounts ordered by committed balance, for TOP and BOTTOM requests.
+ *
+ *  A treap keyed by (balance, account ID) with one preallocated node per
+ *  account, so updates never allocate. Moving an account to a new
+ *  balance and listing the k largest or smallest balances both take
+ *  O(log n) expected time, plus k for the listing.
+ *
+ *  Not thread safe, callers serialize access to a ranking.
+ */
+
+#ifndef RANKING_H
+#define RANKING_H
+
+#include <stdint.h>
+
+struct rank_node {
+    int64_t balance;
+    //Child node indexes, 0 for none
+    int left;
+    int right;
+    uint32_t priority;
+};
+
+struct ranking {
+    //Node i is account i, node 0 is unused
+    struct rank_node* node;
+    int root;
+    int n;
+};
+
+/*
+ *  Create a ranking of n accounts that all have a balance of 0
+ *  Return:  1 if succeeded, 0 if out of memory
+ */
+int ranking_init( struct ranking* r, int n );
+
+/*
+ *  Move an account to its new committed balance
+ *  Input:  int id - Account ID, 1 to n
+ *  Input:  int64_t balance - The new balance
+ */
+void ranking_update( struct ranking* r, int id, int64_t balance );
+
+/*
+ *  List the accounts with the largest or smallest balances
+ *  Input:  int k - Most accounts to list
+ *  Input:  int largest - 1 for the largest balances first, 0 for the smallest first
+ *  Output: int* ids, int64_t* balances - The accounts in order, room for k entries
+ *  Return:  Number of accounts listed, at most k
+ */
+int ranking_top( struct ranking* r, int k, int largest, int* ids, int64_t* balances );
+
+void ranking_free( struct ranking* r );
+
+#endif
@@ -0,0 +1,148 @@
+/*
+ *  Replays a request trace recorded with appserver --trace=FILE.
+ *
+ *  The requests are written to stdout as the text commands the server
+ *  reads, so a trace can be fed to any server build:
+ *
+ *      ./replay trace.bin --speed=2 | ./appserver 8 1000 out.txt
+ *
+ *  By default every request is sent at its original offset from the
+ *  start of the trace. --speed=N compresses the gaps N times, --max
+ *  sends everything as fast as the pipe takes it. How far the replay
+ *  fell behind the intended schedule is reported on stderr, a large lag
+ *  means the server (or the pipe) could not keep up with the pacing.
+ *
+ *  Usage: ./replay [trace_file] [--speed=N] [--max] [--info]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include "ReqTrace.h"
+
+int64_t now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//Sleep until the CLOCK_MONOTONIC time given in microseconds
+void sleep_until(int64_t usec) {
+    struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+//Write one record as the text command the server parses
+void print_request(struct trace_record* rec, int32_t* vals) {
+    if (rec->kind == TRACE_CHECK) {
+        printf("CHECK %d\n", rec->count > 0 ? vals[0] : 0);
+    } else if (rec->kind == TRACE_TRANS) {
+        fputs("TRANS", stdout);
+        for (uint32_t i = 0; i + 1 < rec->count; i += 2) {
+            printf(" %d %d", vals[i], vals[i + 1]);
+        }
+        putchar('\n');
+    } else if (rec->kind == TRACE_AUDIT) {
+        printf("AUDIT\n");
+    } else if (rec->kind == TRACE_SUM) {
+        printf("SUM %d %d\n", rec->count > 1 ? vals[0] : 0, rec->count > 1 ? vals[1] : 0);
+    } else if (rec->kind == TRACE_TOP || rec->kind == TRACE_BOTTOM) {
+        printf("%s %d\n", rec->kind == TRACE_TOP ? "TOP" : "BOTTOM", rec->count > 0 ? vals[0] : 0);
+    } else {
+        printf("END\n");
+    }
+}
+
+int main(int argc, char* argv[]) {
+    struct trace_file t;
+    struct trace_record rec;
+    int32_t* vals = NULL;
+    uint32_t cap = 0;
+    double speed = 1;
+    int info_only = 0;
+    long counts[TRACE_KINDS] = {0};
+    int64_t max_lag = 0, total_lag = 0, last_offset = 0;
+
+    if (argc < 2) {
+        printf("Usage: ./replay [trace_file] [options] | ./appserver [thread_count] [account_count] [output_filename]\n");
+        printf("Options:\n");
+        printf("  --speed=N  Replay N times faster than recorded, e.g. 0.5 for half speed (default 1)\n");
+        printf("  --max      Send every request as fast as possible\n");
+        printf("  --info     Only print what the trace contains\n");
+        return 255;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--speed=", 8) == 0) {
+            speed = atof(argv[i] + 8);
+        } else if (strcmp(argv[i], "--max") == 0) {
+            speed = 0;
+        } else if (strcmp(argv[i], "--info") == 0) {
+            info_only = 1;
+        } else {
+            fprintf(stderr, "ERROR: Unknown option %s\n", argv[i]);
+            return 255;
+        }
+    }
+    if (speed < 0) {
+        fprintf(stderr, "ERROR: --speed must be positive\n");
+        return 255;
+    }
+    if (!trace_open(&t, argv[1])) {
+        fprintf(stderr, "ERROR: %s is not a readable trace\n", argv[1]);
+        return 254;
+    }
+    fprintf(stderr, "Trace recorded against %u accounts\n", t.hdr.num_accounts);
+
+    int64_t base = now_usec();
+    while (trace_next(&t, &rec, &vals, &cap)) {
+        if (rec.kind < TRACE_KINDS) {
+            counts[rec.kind]++;
+        }
+        last_offset = rec.offset_usec;
+        if (info_only) {
+            continue;
+        }
+        if (speed > 0) {
+            int64_t due = base + (int64_t)(rec.offset_usec / speed);
+            int64_t now = now_usec();
+            if (due > now) {
+                //Nothing more is due before this request, let the server see what we have
+                fflush(stdout);
+                sleep_until(due);
+            } else {
+                total_lag += now - due;
+                if (now - due > max_lag) {
+                    max_lag = now - due;
+                }
+            }
+        }
+        print_request(&rec, vals);
+        if (rec.kind == TRACE_END) {
+            break;
+        }
+    }
+    fflush(stdout);
+    int64_t elapsed = now_usec() - base;
+    long total = 0;
+    for (int k = 0; k < TRACE_KINDS; k++) {
+        total += counts[k];
+    }
+
+    fprintf(stderr, "%ld requests (%ld TRANS, %ld CHECK, %ld AUDIT, %ld SUM, %ld TOP/BOTTOM, %ld END) spanning %.3f seconds\n",
+            total, counts[TRACE_TRANS], counts[TRACE_CHECK], counts[TRACE_AUDIT], counts[TRACE_SUM],
+            counts[TRACE_TOP] + counts[TRACE_BOTTOM], counts[TRACE_END], last_offset / 1e6);
+    if (!info_only) {
+        fprintf(stderr, "Replayed in %.3f seconds", elapsed / 1e6);
+        if (speed > 0) {
+            fprintf(stderr, ", lag behind schedule max %.3f ms, average %.3f ms",
+                    max_lag / 1e3, total > 0 ? total_lag / 1e3 / total : 0);
+        }
+        fprintf(stderr, "\n");
+    }
+    trace_close(&t);
+    free(vals);
+    return 0;
+}
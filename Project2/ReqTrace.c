@@ -0,0 +1,78 @@
+#include "ReqTrace.h"
+#include <stdlib.h>
+
+//Records are small, a large buffer keeps capture from costing a syscall per request
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+int trace_create( struct trace_file* t, char* path, int num_accounts ) {
+    t->fp = fopen(path, "wb");
+    if (t->fp == NULL) {
+        return 0;
+    }
+    setvbuf(t->fp, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+    t->hdr.magic = TRACE_MAGIC;
+    t->hdr.version = TRACE_VERSION;
+    t->hdr.num_accounts = num_accounts;
+    t->hdr.reserved = 0;
+    t->hdr.start_usec = 0;
+    t->started = 0;
+    //The start time is filled in once the first request arrives
+    fwrite(&t->hdr, sizeof(t->hdr), 1, t->fp);
+    return 1;
+}
+
+void trace_append( struct trace_file* t, struct timeval* arrival, int kind, int32_t* vals, uint32_t count ) {
+    struct trace_record rec;
+    int64_t now = (int64_t)arrival->tv_sec * 1000000 + arrival->tv_usec;
+
+    if (!t->started) {
+        t->hdr.start_usec = now;
+        t->started = 1;
+    }
+    //Clock steps backwards are recorded as simultaneous arrivals
+    rec.offset_usec = now > t->hdr.start_usec ? now - t->hdr.start_usec : 0;
+    rec.kind = kind;
+    rec.count = count;
+    fwrite(&rec, sizeof(rec), 1, t->fp);
+    if (count > 0) {
+        fwrite(vals, sizeof(int32_t), count, t->fp);
+    }
+}
+
+int trace_open( struct trace_file* t, char* path ) {
+    t->fp = fopen(path, "rb");
+    if (t->fp == NULL) {
+        return 0;
+    }
+    t->started = 0;
+    if (fread(&t->hdr, sizeof(t->hdr), 1, t->fp) != 1
+            || t->hdr.magic != TRACE_MAGIC || t->hdr.version != TRACE_VERSION) {
+        fclose(t->fp);
+        t->fp = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+int trace_next( struct trace_file* t, struct trace_record* rec, int32_t** vals, uint32_t* cap ) {
+    if (fread(rec, sizeof(*rec), 1, t->fp) != 1) {
+        return 0;
+    }
+    if (rec->count > *cap) {
+        *cap = rec->count;
+        *vals = (int32_t*)realloc(*vals, *cap * sizeof(int32_t));
+    }
+    if (rec->count > 0 && fread(*vals, sizeof(int32_t), rec->count, t->fp) != rec->count) {
+        return 0;
+    }
+    return 1;
+}
+
+void trace_close( struct trace_file* t ) {
+    //Go back and store the start time now that it is known
+    if (t->started && fseek(t->fp, 0, SEEK_SET) == 0) {
+        fwrite(&t->hdr, sizeof(t->hdr), 1, t->fp);
+    }
+    fclose(t->fp);
+    t->fp = NULL;
+}
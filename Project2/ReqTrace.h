@@ -0,0 +1,100 @@
+/*
+ *  Binary request traces for the bank server.
+ *
+ *  A trace starts with a struct trace_header and is followed by one
+ *  record per request in arrival order. Each record is a struct
+ *  trace_record followed by count 32-bit values:
+ *
+ *  TRACE_CHECK  count 1, the account ID
+ *  TRACE_TRANS  count 2 * pairs, account ID and amount for each pair
+ *  TRACE_END    count 0
+ *  TRACE_AUDIT  count 0
+ *  TRACE_SUM    count 2, the first and last account of the range
+ *  TRACE_TOP    count 1, the number of accounts to list
+ *  TRACE_BOTTOM count 1, the number of accounts to list
+ *
+ *  Values are stored in host byte order, the magic doubles as a check
+ *  that the trace was written on a machine with the same endianness.
+ */
+
+#ifndef REQ_TRACE_H
+#define REQ_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define TRACE_MAGIC 0x52544b42
+#define TRACE_VERSION 1
+
+#define TRACE_CHECK 0
+#define TRACE_TRANS 1
+#define TRACE_END 2
+#define TRACE_AUDIT 3
+#define TRACE_SUM 4
+#define TRACE_TOP 5
+#define TRACE_BOTTOM 6
+#define TRACE_KINDS 7
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    //Account count the recording server was started with
+    uint32_t num_accounts;
+    uint32_t reserved;
+    //Wall clock time of the first record, in microseconds since the epoch
+    int64_t start_usec;
+};
+
+struct trace_record {
+    //Arrival time relative to start_usec
+    uint64_t offset_usec;
+    uint32_t kind;
+    uint32_t count;
+};
+
+struct trace_file {
+    FILE* fp;
+    struct trace_header hdr;
+    //Has the first record been written or read yet?
+    int started;
+};
+
+/*
+ *  Create a trace file, replacing any existing file
+ *  Input:  char* path - Where to write the trace
+ *  Input:  int num_accounts - Account count stored in the header
+ *  Return:  1 if succeeded, 0 if the file could not be created
+ */
+int trace_create( struct trace_file* t, char* path, int num_accounts );
+
+/*
+ *  Append one request to a trace opened with trace_create()
+ *  Input:  struct timeval* arrival - When the request arrived
+ *  Input:  int kind - One of the TRACE_* kinds above
+ *  Input:  int32_t* vals - The values described at the top of this file
+ *  Input:  uint32_t count - Number of values
+ */
+void trace_append( struct trace_file* t, struct timeval* arrival, int kind, int32_t* vals, uint32_t count );
+
+/*
+ *  Open an existing trace for reading
+ *  Return:  1 if succeeded, 0 if the file is missing or not a trace
+ */
+int trace_open( struct trace_file* t, char* path );
+
+/*
+ *  Read the next record of a trace opened with trace_open()
+ *  Output: struct trace_record* rec - The record header
+ *  Output: int32_t** vals - Values of the record, the buffer is grown with realloc
+ *  In/Out: uint32_t* cap - Capacity of *vals in values
+ *  Return:  1 if a record was read, 0 at the end of the trace or on a truncated record
+ */
+int trace_next( struct trace_file* t, struct trace_record* rec, int32_t** vals, uint32_t* cap );
+
+/*
+ *  Flush and close a trace
+ */
+void trace_close( struct trace_file* t );
+
+#endif
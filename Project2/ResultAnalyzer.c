@@ -0,0 +1,518 @@
+/*
+ *  Analyzer for large bank server result logs.
+ *
+ *  The log is mapped into memory and cut into one chunk per thread at
+ *  line boundaries. Every thread parses its chunk once, keeping its own
+ *  counters, latency histograms and throughput timeline, and the
+ *  results are merged at the end, so memory use does not grow with the
+ *  number of results apart from one bit per request ID.
+ *
+ *  Reported:
+ *  - Result counts per kind, malformed lines, duplicate and missing IDs
+ *  - Sum of all BAL results
+ *  - Latency percentiles (end - start) for TRANS and read-only results,
+ *    from log-linear histograms accurate to about 1.5%
+ *  - Completions per time bucket, optionally written as CSV
+ *
+ *  Usage: ./result-analyzer [log_file] [options]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define KIND_OK 0
+#define KIND_ISF 1
+#define KIND_BAL 2
+#define KIND_TIMEOUT 3
+#define KIND_AUDIT 4
+#define KIND_SUM 5
+#define KIND_TOP 6
+#define KIND_BOTTOM 7
+#define NUM_KINDS 8
+
+//Histograms have 64 linear sub-buckets per power of two of microseconds
+#define SUB_BITS 6
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define NUM_BUCKETS (64 * SUB_BUCKETS)
+
+#define HIST_TRANS 0
+#define HIST_CHECK 1
+
+//Shortest possible result line, "1 OK TIME 0.0 0.0\n", bounds the number of IDs
+#define MIN_LINE_LEN 18
+#define MAX_MISSING_SHOWN 10
+
+struct chunk {
+    const char* begin;
+    const char* end;
+    long counts[NUM_KINDS];
+    long malformed;
+    long duplicates;
+    long out_of_range;
+    long max_id;
+    int64_t balance_sum;
+    int64_t first_start;
+    int64_t last_end;
+    long hist[2][NUM_BUCKETS];
+    int64_t max_latency[2];
+    double latency_sum[2];
+    //Completions per timeline bucket, grown as needed
+    long* timeline;
+    long timeline_len;
+};
+
+const char* kind_names[] = {"OK", "ISF", "BAL", "TIMEOUT", "AUDIT", "SUM", "TOP", "BOTTOM"};
+
+//One bit per request ID, set with atomics since IDs may appear in any chunk
+uint64_t* seen;
+long max_ids;
+int64_t timeline_base;
+int64_t bucket_usec = 1000000;
+
+//Bucket for a latency in microseconds, exact below SUB_BUCKETS and about 1.5% wide above
+int bucket_of(int64_t v) {
+    if (v < SUB_BUCKETS) {
+        return v < 0 ? 0 : (int)v;
+    }
+    int msb = 63 - __builtin_clzll((uint64_t)v);
+    int shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((v >> shift) - SUB_BUCKETS);
+}
+
+//Largest latency that falls into a bucket
+int64_t bucket_value(int b) {
+    if (b < SUB_BUCKETS) {
+        return b;
+    }
+    int shift = b / SUB_BUCKETS - 1;
+    int64_t sub = b % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+//Parse a non-negative integer, returns NULL if there is none at p
+const char* parse_long(const char* p, const char* end, long* out) {
+    long v = 0;
+    const char* start = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+    }
+    *out = v;
+    return p == start ? NULL : p;
+}
+
+//Parse a signed integer such as a balance
+const char* parse_signed(const char* p, const char* end, long* out) {
+    int neg = 0;
+    if (p < end && *p == '-') {
+        neg = 1;
+        p++;
+    }
+    p = parse_long(p, end, out);
+    if (neg) {
+        *out = -*out;
+    }
+    return p;
+}
+
+//Parse a "seconds.microseconds" timestamp into microseconds
+const char* parse_time(const char* p, const char* end, int64_t* out) {
+    long sec, frac = 0;
+    int digits = 0;
+    p = parse_long(p, end, &sec);
+    if (p == NULL) {
+        return NULL;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (digits < 6) {
+                frac = frac * 10 + (*p - '0');
+                digits++;
+            }
+            p++;
+        }
+    }
+    for (; digits < 6; digits++) {
+        frac *= 10;
+    }
+    *out = (int64_t)sec * 1000000 + frac;
+    return p;
+}
+
+const char* skip_spaces(const char* p, const char* end) {
+    while (p != NULL && p < end && *p == ' ') {
+        p++;
+    }
+    return p;
+}
+
+//Match a word followed by a space, returns the position after it or NULL
+const char* match_word(const char* p, const char* end, const char* word) {
+    int len = strlen(word);
+    if (end - p > len && memcmp(p, word, len) == 0 && p[len] == ' ') {
+        return p + len + 1;
+    }
+    return NULL;
+}
+
+void count_completion(struct chunk* c, int64_t end_usec) {
+    long b = (end_usec - timeline_base) / bucket_usec;
+    if (b < 0) {
+        b = 0;
+    }
+    if (b >= c->timeline_len) {
+        long len = c->timeline_len ? c->timeline_len : 1024;
+        while (len <= b) {
+            len *= 2;
+        }
+        c->timeline = (long*)realloc(c->timeline, len * sizeof(long));
+        memset(c->timeline + c->timeline_len, 0, (len - c->timeline_len) * sizeof(long));
+        c->timeline_len = len;
+    }
+    c->timeline[b]++;
+}
+
+//Parse one line, returns 0 if it is not a result line
+int parse_line(struct chunk* c, const char* p, const char* end) {
+    long id, value = 0;
+    int64_t start, stop;
+    const char* q;
+    int kind;
+
+    p = skip_spaces(parse_long(p, end, &id), end);
+    if (p == NULL) {
+        return 0;
+    }
+    if ((q = match_word(p, end, "OK")) != NULL) {
+        kind = KIND_OK;
+    } else if ((q = match_word(p, end, "ISF")) != NULL) {
+        kind = KIND_ISF;
+    } else if ((q = match_word(p, end, "BAL")) != NULL) {
+        kind = KIND_BAL;
+    } else if ((q = match_word(p, end, "TIMEOUT")) != NULL) {
+        kind = KIND_TIMEOUT;
+    } else if ((q = match_word(p, end, "AUDIT")) != NULL) {
+        kind = KIND_AUDIT;
+    } else if ((q = match_word(p, end, "SUM")) != NULL) {
+        kind = KIND_SUM;
+    } else if ((q = match_word(p, end, "TOP")) != NULL) {
+        kind = KIND_TOP;
+    } else if ((q = match_word(p, end, "BOTTOM")) != NULL) {
+        kind = KIND_BOTTOM;
+    } else {
+        return 0;
+    }
+    p = q;
+    if (kind == KIND_ISF || kind == KIND_BAL || kind == KIND_AUDIT || kind == KIND_SUM) {
+        p = skip_spaces(parse_signed(p, end, &value), end);
+        if (p == NULL) {
+            return 0;
+        }
+    }
+    if (kind == KIND_TOP || kind == KIND_BOTTOM) {
+        //The count is followed by that many account:balance pairs
+        long cnt;
+        p = skip_spaces(parse_long(p, end, &cnt), end);
+        for (long i = 0; p != NULL && i < cnt; i++) {
+            while (p < end && *p != ' ') {
+                p++;
+            }
+            p = skip_spaces(p, end);
+        }
+        if (p == NULL) {
+            return 0;
+        }
+    }
+    if ((p = match_word(p, end, "TIME")) == NULL) {
+        return 0;
+    }
+    p = skip_spaces(parse_time(p, end, &start), end);
+    if (p == NULL || parse_time(p, end, &stop) == NULL) {
+        return 0;
+    }
+
+    c->counts[kind]++;
+    if (kind == KIND_BAL) {
+        c->balance_sum += value;
+    }
+    if (id > c->max_id) {
+        c->max_id = id;
+    }
+    if (id < 1 || id > max_ids) {
+        c->out_of_range++;
+    } else {
+        uint64_t bit = 1ULL << ((id - 1) % 64);
+        if (__atomic_fetch_or(&seen[(id - 1) / 64], bit, __ATOMIC_RELAXED) & bit) {
+            c->duplicates++;
+        }
+    }
+    //Queries are read-only like CHECKs
+    int h = kind == KIND_OK || kind == KIND_ISF || kind == KIND_TIMEOUT ? HIST_TRANS : HIST_CHECK;
+    c->hist[h][bucket_of(stop - start)]++;
+    c->latency_sum[h] += stop - start;
+    if (stop - start > c->max_latency[h]) {
+        c->max_latency[h] = stop - start;
+    }
+    if (c->first_start == 0 || start < c->first_start) {
+        c->first_start = start;
+    }
+    if (stop > c->last_end) {
+        c->last_end = stop;
+    }
+    count_completion(c, stop);
+    return 1;
+}
+
+void* parse_chunk(void* arg) {
+    struct chunk* c = (struct chunk*)arg;
+    const char* p = c->begin;
+    while (p < c->end) {
+        const char* nl = memchr(p, '\n', c->end - p);
+        const char* line_end = nl ? nl : c->end;
+        //Blank lines are ignored, anything else has to be a result
+        if (line_end > p && !parse_line(c, p, line_end)) {
+            c->malformed++;
+        }
+        p = line_end + 1;
+    }
+    return NULL;
+}
+
+//Latency at quantile q of a merged histogram, in milliseconds, never above the real maximum
+double percentile_ms(long* hist, long total, int64_t max, double q) {
+    long rank = (long)(q * (total - 1)) + 1;
+    long seen_cnt = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        seen_cnt += hist[b];
+        if (seen_cnt >= rank) {
+            return (bucket_value(b) < max ? bucket_value(b) : max) / 1000.0;
+        }
+    }
+    return max / 1000.0;
+}
+
+void print_latency(char* name, long* hist, double sum, int64_t max) {
+    long total = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        printf("%-7s latency: no results\n", name);
+        return;
+    }
+    printf("%-7s latency (ms): mean %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f\n", name,
+           sum / total / 1000, percentile_ms(hist, total, max, 0.5), percentile_ms(hist, total, max, 0.9),
+           percentile_ms(hist, total, max, 0.99), percentile_ms(hist, total, max, 0.999), max / 1000.0);
+}
+
+int main(int argc, char* argv[]) {
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long expected = 0;
+    char* timeline_path = NULL;
+    struct stat st;
+
+    if (argc < 2) {
+        printf("Usage: ./result-analyzer [log_file] [options]\n");
+        printf("Options:\n");
+        printf("  --threads=N      Parse with N threads (default one per CPU)\n");
+        printf("  --expect=N       Number of requests sent, IDs 1 to N are checked for missing results\n");
+        printf("  --bucket-ms=N    Width of the throughput timeline buckets (default 1000)\n");
+        printf("  --timeline=FILE  Write the timeline as CSV to FILE\n");
+        return 255;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            num_threads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--expect=", 9) == 0) {
+            expected = atol(argv[i] + 9);
+        } else if (strncmp(argv[i], "--bucket-ms=", 12) == 0) {
+            bucket_usec = atol(argv[i] + 12) * 1000;
+        } else if (strncmp(argv[i], "--timeline=", 11) == 0) {
+            timeline_path = argv[i] + 11;
+        } else {
+            printf("ERROR: Unknown option %s\n", argv[i]);
+            return 255;
+        }
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (bucket_usec < 1) {
+        bucket_usec = 1000;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        printf("ERROR: Could not open %s\n", argv[1]);
+        return 254;
+    }
+    if (st.st_size == 0) {
+        printf("ERROR: %s is empty\n", argv[1]);
+        return 254;
+    }
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        printf("ERROR: Could not map %s\n", argv[1]);
+        return 254;
+    }
+    madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+    const char* data_end = data + st.st_size;
+
+    //Every ID a well formed log can hold fits, plus any ID the caller expects
+    max_ids = st.st_size / MIN_LINE_LEN + 1;
+    if (expected > max_ids) {
+        max_ids = expected;
+    }
+    seen = (uint64_t*)calloc((max_ids + 63) / 64, sizeof(uint64_t));
+
+    //The first result completed first, results finishing earlier land in bucket 0
+    struct chunk first;
+    memset(&first, 0, sizeof(first));
+    const char* nl = memchr(data, '\n', st.st_size);
+    //Until the base is known every completion counts in bucket 0, not at its epoch offset
+    timeline_base = INT64_MAX;
+    if (!parse_line(&first, data, nl ? nl : data_end)) {
+        timeline_base = 0;
+    } else {
+        timeline_base = first.first_start;
+    }
+    memset(seen, 0, (max_ids + 63) / 64 * sizeof(uint64_t));
+    free(first.timeline);
+
+    //Cut the log at the first newline after each even split point
+    struct chunk* chunks = (struct chunk*)calloc(num_threads, sizeof(struct chunk));
+    pthread_t* tids = (pthread_t*)malloc(num_threads * sizeof(pthread_t));
+    const char* p = data;
+    for (int i = 0; i < num_threads; i++) {
+        const char* split = i == num_threads - 1 ? data_end : data + st.st_size / num_threads * (i + 1);
+        if (split < p) {
+            split = p;
+        }
+        if (split < data_end) {
+            const char* n = memchr(split, '\n', data_end - split);
+            split = n ? n + 1 : data_end;
+        }
+        chunks[i].begin = p;
+        chunks[i].end = split;
+        p = split;
+        pthread_create(&tids[i], NULL, parse_chunk, &chunks[i]);
+    }
+
+    //Merge everything into the first chunk
+    struct chunk* all = &chunks[0];
+    pthread_join(tids[0], NULL);
+    for (int i = 1; i < num_threads; i++) {
+        struct chunk* c = &chunks[i];
+        pthread_join(tids[i], NULL);
+        for (int k = 0; k < NUM_KINDS; k++) {
+            all->counts[k] += c->counts[k];
+        }
+        all->malformed += c->malformed;
+        all->duplicates += c->duplicates;
+        all->out_of_range += c->out_of_range;
+        all->balance_sum += c->balance_sum;
+        if (c->max_id > all->max_id) {
+            all->max_id = c->max_id;
+        }
+        if (c->first_start != 0 && (all->first_start == 0 || c->first_start < all->first_start)) {
+            all->first_start = c->first_start;
+        }
+        if (c->last_end > all->last_end) {
+            all->last_end = c->last_end;
+        }
+        for (int h = 0; h < 2; h++) {
+            for (int b = 0; b < NUM_BUCKETS; b++) {
+                all->hist[h][b] += c->hist[h][b];
+            }
+            all->latency_sum[h] += c->latency_sum[h];
+            if (c->max_latency[h] > all->max_latency[h]) {
+                all->max_latency[h] = c->max_latency[h];
+            }
+        }
+        if (c->timeline_len > all->timeline_len) {
+            all->timeline = (long*)realloc(all->timeline, c->timeline_len * sizeof(long));
+            memset(all->timeline + all->timeline_len, 0, (c->timeline_len - all->timeline_len) * sizeof(long));
+            all->timeline_len = c->timeline_len;
+        }
+        for (long b = 0; b < c->timeline_len; b++) {
+            all->timeline[b] += c->timeline[b];
+        }
+        free(c->timeline);
+    }
+
+    //--------------Correctness--------------
+    long results = 0;
+    for (int k = 0; k < NUM_KINDS; k++) {
+        results += all->counts[k];
+    }
+    printf("Results: %ld (", results);
+    for (int k = 0; k < NUM_KINDS; k++) {
+        printf("%s%s %ld", k ? ", " : "", kind_names[k], all->counts[k]);
+    }
+    printf(")\n");
+    printf("Malformed lines: %ld, duplicate IDs: %ld, IDs out of range: %ld\n", all->malformed, all->duplicates, all->out_of_range);
+    printf("Sum of BAL results: %ld\n", (long)all->balance_sum);
+
+    long check_upto = expected > 0 ? expected : all->max_id;
+    if (check_upto > max_ids) {
+        check_upto = max_ids;
+    }
+    long missing = 0;
+    for (long id = 1; id <= check_upto; id++) {
+        if (!(seen[(id - 1) / 64] & (1ULL << ((id - 1) % 64)))) {
+            if (missing < MAX_MISSING_SHOWN) {
+                printf("%s%ld", missing ? " " : "Missing IDs: ", id);
+            }
+            missing++;
+        }
+    }
+    if (missing > MAX_MISSING_SHOWN) {
+        printf(" ...");
+    }
+    printf("%sMissing results for IDs 1 to %ld: %ld\n", missing ? "\n" : "", check_upto, missing);
+
+    //--------------Latency and throughput--------------
+    print_latency("TRANS", all->hist[HIST_TRANS], all->latency_sum[HIST_TRANS], all->max_latency[HIST_TRANS]);
+    print_latency("CHECK", all->hist[HIST_CHECK], all->latency_sum[HIST_CHECK], all->max_latency[HIST_CHECK]);
+
+    double span = (all->last_end - all->first_start) / 1e6;
+    long peak = 0, used = 0;
+    for (long b = 0; b < all->timeline_len; b++) {
+        if (all->timeline[b] > peak) {
+            peak = all->timeline[b];
+        }
+        if (all->timeline[b] > 0) {
+            used = b + 1;
+        }
+    }
+    printf("Span: %.3f seconds, average throughput %.1f results/s, peak %.1f results/s\n",
+           span, span > 0 ? results / span : 0, peak / (bucket_usec / 1e6));
+
+    if (timeline_path != NULL) {
+        FILE* out = fopen(timeline_path, "w");
+        if (out == NULL) {
+            printf("ERROR: Could not open %s\n", timeline_path);
+            return 254;
+        }
+        fprintf(out, "bucket_start_s,results,results_per_s\n");
+        for (long b = 0; b < used; b++) {
+            fprintf(out, "%.3f,%ld,%.1f\n", b * bucket_usec / 1e6, all->timeline[b], all->timeline[b] / (bucket_usec / 1e6));
+        }
+        fclose(out);
+    }
+
+    free(all->timeline);
+    free(chunks);
+    free(tids);
+    free(seen);
+    munmap((void*)data, st.st_size);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ *  Decoder for binary bank server result logs (--log-format=binary).
+ *
+ *  Writes the same text lines the server writes with --log-format=text,
+ *  so Project2Test, result-analyzer and the other tools work on the
+ *  output unchanged. Records are read in large blocks and formatted by
+ *  hand into one output buffer, printf is not used per field.
+ *
+ *  Usage: ./result-decode [binary_log] [text_output]
+ *  The text goes to stdout if no output file is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "ResultLog.h"
+
+//Records decoded per read
+#define BLOCK_RECORDS 8192
+//Longest text of one record: a line without its rank entries, or one " acc:bal" entry
+#define MAX_RECORD_TEXT 128
+
+static const char* kind_names[RESULT_KINDS] = {"OK", "ISF", "BAL", "TIMEOUT", "AUDIT", "SUM", "TOP", "BOTTOM", ""};
+
+//Append the decimal digits of v, returns the new end of the buffer
+char* put_int(char* p, int64_t v) {
+    char digits[20];
+    int n = 0;
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    if (v < 0) {
+        *p++ = '-';
+    }
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    while (n > 0) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+//Append " s.uuuuuu" for a microsecond timestamp
+char* put_time(char* p, int64_t usec) {
+    *p++ = ' ';
+    p = put_int(p, usec / 1000000);
+    *p++ = '.';
+    int frac = usec % 1000000;
+    for (int div = 100000; div > 0; div /= 10) {
+        *p++ = '0' + frac / div % 10;
+    }
+    return p;
+}
+
+char* put_str(char* p, const char* s) {
+    while (*s) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+int main(int argc, char* argv[]) {
+    struct result_record* recs;
+    FILE* in;
+    FILE* out = stdout;
+
+    if (argc < 2) {
+        printf("Usage: ./result-decode [binary_log] [text_output]\n");
+        return 255;
+    }
+    in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        printf("ERROR: Could not open %s\n", argv[1]);
+        return 254;
+    }
+    if (!result_log_check(in)) {
+        printf("ERROR: %s is not a binary result log of this version\n", argv[1]);
+        return 254;
+    }
+    if (argc > 2) {
+        out = fopen(argv[2], "w");
+        if (out == NULL) {
+            printf("ERROR: Could not open %s\n", argv[2]);
+            return 254;
+        }
+    }
+
+    recs = malloc(BLOCK_RECORDS * sizeof(struct result_record));
+    char* text = malloc(BLOCK_RECORDS * MAX_RECORD_TEXT);
+    //Rank entries still owed to the last TOP or BOTTOM line, and that line's times
+    int64_t entries_left = 0;
+    int64_t rank_start = 0, rank_end = 0;
+    long bad = 0;
+    size_t got;
+
+    while ((got = fread(recs, sizeof(struct result_record), BLOCK_RECORDS, in)) > 0) {
+        char* p = text;
+        for (size_t i = 0; i < got; i++) {
+            struct result_record* r = &recs[i];
+            if (entries_left > 0) {
+                if (r->kind == RESULT_RANK_ENTRY) {
+                    *p++ = ' ';
+                    p = put_int(p, r->request_id);
+                    *p++ = ':';
+                    p = put_int(p, r->value);
+                    if (--entries_left == 0) {
+                        p = put_str(p, " TIME");
+                        p = put_time(p, rank_start);
+                        p = put_time(p, rank_end);
+                        *p++ = '\n';
+                    }
+                    continue;
+                }
+                //The entries were cut short, finish the line with what was there
+                entries_left = 0;
+                p = put_str(p, " TIME");
+                p = put_time(p, rank_start);
+                p = put_time(p, rank_end);
+                *p++ = '\n';
+                bad++;
+            }
+            if (r->kind >= RESULT_RANK_ENTRY) {
+                bad++;
+                continue;
+            }
+            p = put_int(p, r->request_id);
+            *p++ = ' ';
+            p = put_str(p, kind_names[r->kind]);
+            if (r->kind != RESULT_OK && r->kind != RESULT_TIMEOUT) {
+                *p++ = ' ';
+                p = put_int(p, r->value);
+            }
+            if ((r->kind == RESULT_TOP || r->kind == RESULT_BOTTOM) && r->value > 0) {
+                //The line is finished by its entries
+                entries_left = r->value;
+                rank_start = r->start_us;
+                rank_end = r->end_us;
+                continue;
+            }
+            p = put_str(p, " TIME");
+            p = put_time(p, r->start_us);
+            p = put_time(p, r->end_us);
+            *p++ = '\n';
+        }
+        fwrite(text, 1, p - text, out);
+    }
+    if (entries_left > 0) {
+        char tail[MAX_RECORD_TEXT];
+        char* p = put_str(tail, " TIME");
+        p = put_time(p, rank_start);
+        p = put_time(p, rank_end);
+        *p++ = '\n';
+        fwrite(tail, 1, p - tail, out);
+        bad++;
+    }
+    if (bad > 0) {
+        fprintf(stderr, "WARNING: %ld malformed records\n", bad);
+    }
+
+    free(recs);
+    free(text);
+    fclose(in);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return bad > 0;
+}
@@ -0,0 +1,79 @@
+/*
+ *  Result kinds of the bank server and its binary result log.
+ *
+ *  With --log-format=binary the output file starts with a struct
+ *  result_header and holds one fixed-size struct result_record per
+ *  result line instead of text. ./result-decode turns it back into
+ *  the text format, line for line:
+ *
+ *  RESULT_OK       value unused                 "ID OK TIME s e"
+ *  RESULT_ISF      value is the account         "ID ISF acc TIME s e"
+ *  RESULT_BAL      value is the balance         "ID BAL bal TIME s e"
+ *  RESULT_TIMEOUT  value unused                 "ID TIMEOUT TIME s e"
+ *  RESULT_AUDIT    value is the total           "ID AUDIT total TIME s e"
+ *  RESULT_SUM      value is the range total     "ID SUM total TIME s e"
+ *  RESULT_TOP      value is the entry count     "ID TOP cnt acc:bal ... TIME s e"
+ *  RESULT_BOTTOM   value is the entry count     "ID BOTTOM cnt acc:bal ... TIME s e"
+ *
+ *  A TOP or BOTTOM record is directly followed by its count of
+ *  RESULT_RANK_ENTRY records, each holding the account in request_id
+ *  and its balance in value. Values are stored in host byte order,
+ *  the magic doubles as an endianness check like in ReqTrace.h.
+ */
+
+#ifndef RESULT_LOG_H
+#define RESULT_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define RESULT_OK 0
+#define RESULT_ISF 1
+#define RESULT_BAL 2
+#define RESULT_TIMEOUT 3
+#define RESULT_AUDIT 4
+#define RESULT_SUM 5
+#define RESULT_TOP 6
+#define RESULT_BOTTOM 7
+#define RESULT_RANK_ENTRY 8
+#define RESULT_KINDS 9
+
+#define RESULT_LOG_MAGIC 0x53455242
+#define RESULT_LOG_VERSION 2
+
+struct result_header {
+    uint32_t magic;
+    uint32_t version;
+    //sizeof(struct result_record), so readers catch a layout change
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+//32 bytes against roughly 50 for a text line, and no formatting on the worker
+struct result_record {
+    //Wall clock start and end times in microseconds since the epoch, the
+    //resolution of gettimeofday() the server times requests with
+    int64_t start_us;
+    int64_t end_us;
+    int64_t value;
+    int32_t request_id;
+    uint8_t kind;
+    uint8_t reserved[3];
+};
+
+static inline void result_log_header(FILE* out) {
+    struct result_header hdr = {RESULT_LOG_MAGIC, RESULT_LOG_VERSION, sizeof(struct result_record), 0};
+    fwrite(&hdr, sizeof(hdr), 1, out);
+}
+
+/*
+ *  Read and check the header of a binary result log
+ *  Return:  1 if the file is a result log this build can read, 0 otherwise
+ */
+static inline int result_log_check(FILE* in) {
+    struct result_header hdr;
+    return fread(&hdr, sizeof(hdr), 1, in) == 1 && hdr.magic == RESULT_LOG_MAGIC &&
+           hdr.version == RESULT_LOG_VERSION && hdr.record_size == sizeof(struct result_record);
+}
+
+#endif